@@ -0,0 +1,485 @@
+/* redo-bench.c: libredo benchmarks.
+ *
+ * Copyright (C) 2013 by Brian Raiter. This program is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software
+ * Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "redo.h"
+
+/* The size of the state data used by the benchmarks.
+ */
+#define SIZE_STATE 32
+
+/* The number of operations that are timed in each measurement.
+ */
+#define OPCOUNT 20000
+
+/* A state data buffer for general use.
+ */
+static unsigned char sbuf[SIZE_STATE];
+
+/* Fill the state buffer with a state that is unique to the given
+ * number.
+ */
+static void *makestate(unsigned long n)
+{
+    memset(sbuf, 0, sizeof sbuf);
+    memcpy(sbuf, &n, sizeof n);
+    return sbuf;
+}
+
+/* Return the number of nanoseconds per operation, given the clock
+ * ticks that elapsed while performing count operations.
+ */
+static double nsperop(clock_t elapsed, int count)
+{
+    return (double)elapsed * 1e9 / CLOCKS_PER_SEC / count;
+}
+
+/* Create a session containing the given number of positions. The
+ * positions are arranged in a bushy tree so that the paths stay
+ * short. An array of positions that can be used as parents during
+ * the timed operations is filled in.
+ */
+static redo_session *buildsession(unsigned long size,
+                                  redo_position **parents, int parentcount)
+{
+    redo_session *session;
+    redo_position **level;
+    unsigned long n, i;
+
+    session = redo_beginsession(makestate(0), SIZE_STATE, 0);
+    level = malloc(size * sizeof *level);
+    if (!session || !level) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    level[0] = redo_getfirstposition(session);
+    for (n = 1 ; n < size ; ++n) {
+        level[n] = redo_addposition(session, level[(n - 1) / 16], n % 16,
+                                    makestate(n), 0, redo_check);
+        if (!level[n]) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0 ; i < (unsigned long)parentcount ; ++i)
+        parents[i] = level[(i * 7919) % size];
+    free(level);
+    return session;
+}
+
+/* Measure the cost of deleting positions from sessions of various
+ * sizes. Each measurement adds a batch of leaf positions, and then
+ * times their deletion with redo_dropposition().
+ */
+static void bench_dropposition(void)
+{
+    static unsigned long const sizes[] = { 1000, 10000, 100000, 1000000 };
+    redo_session *session;
+    redo_position **parents, **leaves;
+    clock_t addtime, droptime;
+    unsigned long size;
+    int i, n;
+
+    parents = malloc(OPCOUNT * sizeof *parents);
+    leaves = malloc(OPCOUNT * sizeof *leaves);
+    if (!parents || !leaves) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-24s %12s %12s\n", "session size", "add (ns)", "drop (ns)");
+    for (n = 0 ; n < (int)(sizeof sizes / sizeof *sizes) ; ++n) {
+        size = sizes[n];
+        session = buildsession(size, parents, OPCOUNT);
+        addtime = clock();
+        for (i = 0 ; i < OPCOUNT ; ++i)
+            leaves[i] = redo_addposition(session, parents[i], -1 - i,
+                                         makestate(size + i), 0, redo_check);
+        addtime = clock() - addtime;
+        droptime = clock();
+        for (i = 0 ; i < OPCOUNT ; ++i)
+            redo_dropposition(session, leaves[i]);
+        droptime = clock() - droptime;
+        printf("%-24lu %12.1f %12.1f\n", size,
+               nsperop(addtime, OPCOUNT), nsperop(droptime, OPCOUNT));
+        redo_endsession(session);
+    }
+
+    free(leaves);
+    free(parents);
+}
+
+/* Measure the cost of checking for cycles at the end of paths of
+ * various lengths, when no cycle is present. The state checked is
+ * first new to the session, and then also present near the start of
+ * the tree on another branch.
+ */
+static void bench_suppresscycle(void)
+{
+    static unsigned long const depths[] = { 100, 1000, 10000, 50000 };
+    redo_session *session;
+    redo_position *pos, *end, *side;
+    clock_t elapsed, leaftime, opentime;
+    unsigned long depth, n;
+    int i, k;
+
+    printf("%-24s %12s %12s %12s\n", "path length", "check (ns)",
+           "leaf (ns)", "open (ns)");
+    for (k = 0 ; k < (int)(sizeof depths / sizeof *depths) ; ++k) {
+        depth = depths[k];
+        session = redo_beginsession(makestate(0), SIZE_STATE, 0);
+        if (!session) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        pos = redo_getfirstposition(session);
+        for (n = 1 ; n <= depth ; ++n) {
+            pos = redo_addposition(session, pos, 0, makestate(n), 0,
+                                   redo_check);
+            if (!pos) {
+                fprintf(stderr, "out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        end = pos;
+        elapsed = clock();
+        for (i = 0 ; i < OPCOUNT ; ++i)
+            redo_suppresscycle(session, &end, makestate(depth + 1 + i), 4);
+        elapsed = clock() - elapsed;
+
+        /* Add the checked state one move away from the start, on a
+         * different branch, so that it transposes with the end of the
+         * path. Time the check while that position is a leaf, and
+         * again after a move has been added from it.
+         */
+        side = redo_addposition(session, redo_getfirstposition(session),
+                                1, makestate(depth + 1), 0, redo_check);
+        if (!side) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        leaftime = clock();
+        for (i = 0 ; i < OPCOUNT ; ++i) {
+            pos = end;
+            redo_suppresscycle(session, &pos, makestate(depth + 1), 4);
+        }
+        leaftime = clock() - leaftime;
+        if (!redo_addposition(session, side, 0, makestate(depth + 2), 0,
+                              redo_check)) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        opentime = clock();
+        for (i = 0 ; i < OPCOUNT ; ++i) {
+            pos = end;
+            redo_suppresscycle(session, &pos, makestate(depth + 1), 4);
+        }
+        opentime = clock() - opentime;
+
+        printf("%-24lu %12.1f %12.1f %12.1f\n", depth,
+               nsperop(elapsed, OPCOUNT), nsperop(leaftime, OPCOUNT),
+               nsperop(opentime, OPCOUNT));
+        redo_endsession(session);
+    }
+}
+
+/* Measure the cost of extending a single line of play to various
+ * depths, and of undoing it again by deleting its positions from the
+ * end. The longest lines require the library to be built with
+ * REDO_WIDE_COUNTS, and are skipped otherwise.
+ */
+static void bench_deepline(void)
+{
+    static unsigned long const depths[] = { 1000, 10000, 60000,
+                                            300000, 1000000 };
+    redo_session *session;
+    redo_position *pos;
+    clock_t addtime, droptime;
+    unsigned long depth, n;
+    int k;
+
+    printf("%-24s %12s %12s\n", "line length", "add (ns)", "undo (ns)");
+    for (k = 0 ; k < (int)(sizeof depths / sizeof *depths) ; ++k) {
+        depth = depths[k];
+        if (sizeof(redo_count) == 2 && depth > 0xFFFF) {
+            printf("(longer lines are measured by redo-bench-wide)\n");
+            break;
+        }
+        session = redo_beginsession(makestate(0), SIZE_STATE, 0);
+        if (!session) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        pos = redo_getfirstposition(session);
+        addtime = clock();
+        for (n = 1 ; n <= depth ; ++n) {
+            pos = redo_addposition(session, pos, 0, makestate(n),
+                                   n == depth, redo_check);
+            if (!pos) {
+                fprintf(stderr, "out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        addtime = clock() - addtime;
+        droptime = clock();
+        while (pos->prev)
+            pos = redo_dropposition(session, pos);
+        droptime = clock() - droptime;
+        printf("%-24lu %12.1f %12.1f\n", depth,
+               nsperop(addtime, depth), nsperop(droptime, depth));
+        redo_endsession(session);
+    }
+}
+
+/* Return the time taken to look up the branches of a position with
+ * the given number of branches, chosen in a pseudorandom order, with
+ * branch indexes created at the given threshold (zero for none).
+ */
+static clock_t timefanout(int fanout, int threshold)
+{
+    redo_session *session;
+    redo_position *root;
+    clock_t elapsed;
+    unsigned long r;
+    int i;
+
+    session = redo_beginsession(makestate(0), SIZE_STATE, 0);
+    if (!session || !redo_setbranchindex(session, threshold)) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    root = redo_getfirstposition(session);
+    for (i = 0 ; i < fanout ; ++i) {
+        if (!redo_addposition(session, root, i * 7, makestate(i + 1), 0,
+                              redo_nocheck)) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    r = 1;
+    elapsed = clock();
+    for (i = 0 ; i < OPCOUNT ; ++i) {
+        r = r * 1103515245 + 12345;
+        if (!redo_getnextposition(root, (int)((r >> 8) % fanout) * 7)) {
+            fprintf(stderr, "missing branch\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    elapsed = clock() - elapsed;
+    redo_endsession(session);
+    return elapsed;
+}
+
+/* Measure the cost of following a move from positions with many
+ * branches, with and without branch indexes.
+ */
+static void bench_fanout(void)
+{
+    static int const fanouts[] = { 4, 16, 64, 256, 1024 };
+    int k;
+
+    printf("%-24s %12s %12s\n", "branches", "list (ns)", "index (ns)");
+    for (k = 0 ; k < (int)(sizeof fanouts / sizeof *fanouts) ; ++k)
+        printf("%-24d %12.1f %12.1f\n", fanouts[k],
+               nsperop(timefanout(fanouts[k], 0), OPCOUNT),
+               nsperop(timefanout(fanouts[k], 16), OPCOUNT));
+}
+
+/* Hash values are stored here, to keep the compiler from optimizing
+ * away the calls to the hash functions.
+ */
+static volatile unsigned int hashsink;
+
+/* The library's original state hash function, a straightforward
+ * Meiyan hash, used as a point of comparison.
+ */
+static unsigned int oldhashvalue(void const *state, int size)
+{
+    uint32_t const m = 0x000AD3E7;
+    uint32_t const seed = 0x811C9DC5;
+    unsigned int const *data = state;
+    size_t len = size;
+    uint32_t h, k, i;
+
+    for (h = seed ; len >= 2 * sizeof *data ; len -= 2 * sizeof *data) {
+        k = *data++;
+        k = ((k << 5) | (k >> 27)) ^ *data++;
+        h = (h ^ k) * m;
+    }
+    for (i = 0 ; i < len ; ++i)
+        h ^= ((unsigned char*)data)[i] << (i % 4 * 8);
+    h *= m;
+    return h ^ (h >> 16);
+}
+
+/* Both hash functions are called through these pointers, so that
+ * neither call can be inlined and specialized for a constant size.
+ * This keeps the comparison fair: inside the library the hash is
+ * never called with a size known at compile time.
+ */
+static unsigned int (*volatile oldhash)(void const*, int) = oldhashvalue;
+static unsigned int (*volatile newhash)(void const*, int) = redo_hashstate;
+
+/* Measure the speed of the state hash function for various state
+ * sizes, compared to the original hash function.
+ */
+static void bench_hashing(void)
+{
+    static int const sizes[] = { 32, 256, 1024, 4096, 16384 };
+    unsigned int *buf;
+    clock_t oldtime, newtime;
+    int count, size, i, n;
+
+    buf = malloc(sizes[sizeof sizes / sizeof *sizes - 1]);
+    if (!buf) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-24s %12s %12s\n", "state size", "old (MB/s)", "new (MB/s)");
+    for (n = 0 ; n < (int)(sizeof sizes / sizeof *sizes) ; ++n) {
+        size = sizes[n];
+        count = (1 << 30) / size;
+        for (i = 0 ; i < size ; ++i)
+            ((unsigned char*)buf)[i] = (unsigned char)(i * 131 + n);
+        oldtime = clock();
+        for (i = 0 ; i < count ; ++i) {
+            buf[0] = i;
+            hashsink = oldhash(buf, size);
+        }
+        oldtime = clock() - oldtime;
+        newtime = clock();
+        for (i = 0 ; i < count ; ++i) {
+            buf[0] = i;
+            hashsink = newhash(buf, size);
+        }
+        newtime = clock() - newtime;
+        printf("%-24d %12.1f %12.1f\n", size,
+               1000.0 / nsperop(oldtime, count) * size,
+               1000.0 / nsperop(newtime, count) * size);
+    }
+
+    free(buf);
+}
+
+/* The size of the states used to compare the storage modes.
+ */
+#define SIZE_BIGSTATE 1024
+
+/* Apply a move to a large state. Each move changes only a few bytes.
+ */
+static void applybenchmove(void *state, int size, int move, void *data)
+{
+    unsigned char *s = state;
+
+    (void)data;
+    memcpy(s, &move, sizeof move);
+    s[(move * 61) % size] ^= 1;
+}
+
+/* Build a session of large states using the given storage mode, and
+ * measure the cost of adding positions, of retrieving their states,
+ * and of walking from each position back to the root.
+ */
+static void bench_storagemode(int mode, char const *name)
+{
+    static int const count = 100000;
+    redo_session *session;
+    redo_position **positions;
+    unsigned char *buf;
+    redo_position *pos;
+    clock_t addtime, gettime, walktime;
+    unsigned long sum;
+    int i;
+
+    buf = calloc(SIZE_BIGSTATE, 1);
+    positions = malloc(count * sizeof *positions);
+    if (!buf || !positions) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    session = redo_beginsession(buf, SIZE_BIGSTATE, 0);
+    if (!session || !redo_setmovecallback(session, applybenchmove, NULL)
+                  || !redo_setstoragemode(session, mode, 0)) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    positions[0] = redo_getfirstposition(session);
+    addtime = clock();
+    for (i = 1 ; i < count ; ++i) {
+        memcpy(buf, redo_getsavedstate(positions[(i - 1) / 2]),
+               SIZE_BIGSTATE);
+        applybenchmove(buf, SIZE_BIGSTATE, i, NULL);
+        positions[i] = redo_addposition(session, positions[(i - 1) / 2], i,
+                                        buf, 0, redo_check);
+        if (!positions[i]) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    addtime = clock() - addtime;
+    sum = 0;
+    gettime = clock();
+    for (i = 0 ; i < count ; ++i)
+        sum += ((unsigned char const*)
+                        redo_getsavedstate(positions[(i * 7919) % count]))[0];
+    gettime = clock() - gettime;
+    walktime = clock();
+    for (i = 0 ; i < count ; ++i)
+        for (pos = positions[(i * 7919) % count] ; pos ; pos = pos->prev)
+            sum += pos->movecount;
+    walktime = clock() - walktime;
+    hashsink = sum;
+    printf("%-24s %12.1f %12.1f %12.1f\n", name, nsperop(addtime, count),
+           nsperop(gettime, count), nsperop(walktime, count));
+    redo_endsession(session);
+    free(positions);
+    free(buf);
+}
+
+/* Compare the storage modes.
+ */
+static void bench_storage(void)
+{
+    printf("%-24s %12s %12s %12s\n", "storage mode",
+           "add (ns)", "get (ns)", "walk (ns)");
+    bench_storagemode(redo_storefull, "full");
+    bench_storagemode(redo_storedeltas, "deltas");
+    bench_storagemode(redo_storekeyframes, "keyframes");
+    bench_storagemode(redo_storeinterned, "interned");
+    bench_storagemode(redo_storeseparate, "separate");
+}
+
+int main(void)
+{
+#ifdef REDO_WIDE_COUNTS
+    /* The wide-count build exists to measure lines that are too long
+     * for the default build, so it only runs that benchmark.
+     */
+    printf("REDO_WIDE_COUNTS build\n");
+    bench_deepline();
+    return 0;
+#endif
+    bench_hashing();
+    printf("\n");
+    bench_dropposition();
+    printf("\n");
+    bench_suppresscycle();
+    printf("\n");
+    bench_deepline();
+    printf("\n");
+    bench_fanout();
+    printf("\n");
+    bench_storage();
+    return 0;
+}
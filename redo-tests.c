@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 #include "redo.h"
 
 /* Variables initialized during setup().
@@ -40,10 +41,15 @@ static void test_init(void)
     assert(s);
     redo_endsession(s);
 
-    /* Verify that redo_beginsession() rejects a too-large statesize. */
+    /* Verify that redo_beginsession() accepts a statesize past 64k,
+     * and rejects one too large to be addressed.
+     */
 
-    p = malloc(0xFFFF);
-    s = redo_beginsession(p, 0xFFFF, 0);
+    p = calloc(0x10000, 1);
+    s = redo_beginsession(p, 0x10000, 0);
+    assert(s);
+    redo_endsession(s);
+    s = redo_beginsession(p, INT_MAX, 0);
     assert(s == NULL);
     free(p);
 
@@ -97,7 +103,7 @@ static void test_statecompares(void)
         pos = redo_addposition(session, rootpos, i, state, 0, redo_check);
         assert(pos);
         assert(pos->better == NULL);
-        assert(rootpos->nextcount == i + 1);
+        assert((int)rootpos->nextcount == i + 1);
     }
     assert(redo_getsessionsize(session) == i + 1);
 
@@ -689,14 +695,1778 @@ static void test_endpoints(void)
     teardown();
 }
 
+/* Verify that equivalent states are still correctly identified when
+ * the session contains far more positions than hash table buckets.
+ */
+static void test_largesession(void)
+{
+    redo_position *pos, *prev, *pos2;
+    int const count = 20000;
+    int i;
+
+    setup();
+    memset(sbuf, 0, sizeof sbuf);
+
+    /* Verify that the hash table's load target can be changed. */
+
+    assert(redo_sethashload(session, 50) == 100);
+    assert(redo_sethashload(session, 0) == 50);
+    assert(redo_sethashload(session, 250) == 50);
+
+    /* Build a long line of positions, each with a unique state. */
+
+    prev = rootpos;
+    for (i = 1 ; i <= count ; ++i) {
+        memcpy(sbuf, &i, sizeof i);
+        pos = redo_addposition(session, prev, 0, sbuf, 0, redo_check);
+        assert(pos);
+        assert(pos->better == NULL);
+        prev = pos;
+    }
+    assert(redo_getsessionsize(session) == count + 1);
+    assert(redo_getcollisioncount(session) == 0);
+
+    /* Verify that a shortcut to any of them is recognized. */
+
+    for (i = count ; i > 0 ; i -= 997) {
+        memcpy(sbuf, &i, sizeof i);
+        pos = redo_addposition(session, rootpos, i, sbuf, 0, redo_check);
+        assert(pos);
+        assert(pos->movecount == 1);
+        assert(pos->better == NULL || i == 1);
+    }
+
+    /* Verify that dropped positions are no longer found. */
+
+    i = count;
+    memcpy(sbuf, &i, sizeof i);
+    pos = redo_getnextposition(rootpos, i);
+    assert(pos);
+    assert(redo_dropposition(session, pos) == rootpos);
+    pos2 = redo_addposition(session, prev, 1, sbuf, 0, redo_check);
+    assert(pos2);
+    assert(pos2->better == prev);
+
+    teardown();
+}
+
+/* Verify that caller-supplied hash values are used in place of the
+ * library's own.
+ */
+static void test_hashedstates(void)
+{
+    redo_position *pos1a, *pos1b, *pos2a, *pos3a, *pos;
+
+    setup();
+    memset(sbuf, '.', sizeof sbuf);
+    redo_setpositionhash(session, rootpos, 1);
+
+    /* Verify that a shared hash value doesn't make states equivalent. */
+
+    sbuf[1] = 'a';
+    pos1a = redo_addpositionhashed(session, rootpos, 'a', sbuf, 7, 0,
+                                   redo_check);
+    assert(pos1a);
+    assert(pos1a->better == NULL);
+    sbuf[1] = 'b';
+    pos1b = redo_addpositionhashed(session, rootpos, 'b', sbuf, 7, 0,
+                                   redo_check);
+    assert(pos1b);
+    assert(pos1b->better == NULL);
+    assert(redo_getcollisioncount(session) == 1);
+
+    /* Verify that identical states are found via the supplied value. */
+
+    sbuf[1] = 'a';
+    pos2a = redo_addpositionhashed(session, pos1b, 'a', sbuf, 7, 0,
+                                   redo_check);
+    assert(pos2a);
+    assert(pos2a->better == pos1a);
+
+    /* Verify that a different hash value hides an identical state. */
+
+    pos3a = redo_addpositionhashed(session, pos2a, 'a', sbuf, 8, 0,
+                                   redo_check);
+    assert(pos3a);
+    assert(pos3a->better == NULL);
+
+    /* Verify that a cycle back to the root is detected. */
+
+    memset(sbuf, 0, sizeof sbuf);
+    pos = pos3a;
+    assert(!redo_suppresscyclehashed(session, &pos, sbuf, 7, 0));
+    assert(pos == pos3a);
+    assert(redo_suppresscyclehashed(session, &pos, sbuf, 1, 0));
+    assert(pos == rootpos);
+    assert(redo_getsessionsize(session) == 5);
+
+    teardown();
+}
+
+/* A state hash function that ignores the odd-numbered bytes.
+ */
+static unsigned int hasheven(void const *state, int size, void *data)
+{
+    unsigned char const *s = state;
+    unsigned int h;
+    int i;
+
+    ++*(int*)data;
+    for (h = 0, i = 0 ; i < size ; i += 2)
+        h = h * 31 + s[i];
+    return h;
+}
+
+/* A state comparison function that ignores the odd-numbered bytes.
+ */
+static int compareeven(void const *state1, void const *state2,
+                       int size, void *data)
+{
+    unsigned char const *s1 = state1;
+    unsigned char const *s2 = state2;
+    int i;
+
+    (void)data;
+    for (i = 0 ; i < size ; i += 2)
+        if (s1[i] != s2[i])
+            return 1;
+    return 0;
+}
+
+/* Verify that the caller can replace the hash and compare functions.
+ */
+static void test_statecallbacks(void)
+{
+    redo_position *pos1a, *pos1b, *pos2a, *pos;
+    int callcount;
+
+    setup();
+    memset(sbuf, '.', sizeof sbuf);
+
+    /* Verify that changing the hash function rehashes the session. */
+
+    callcount = 0;
+    redo_setstatecallbacks(session, hasheven, compareeven, &callcount);
+    assert(callcount == 1);
+
+    /* Verify that states are compared using the caller's functions. */
+
+    sbuf[0] = 'a';
+    sbuf[1] = 'a';
+    pos1a = redo_addposition(session, rootpos, 'a', sbuf, 0, redo_check);
+    assert(pos1a);
+    assert(callcount == 2);
+    sbuf[1] = 'b';
+    pos1b = redo_addposition(session, rootpos, 'b', sbuf, 0, redo_check);
+    assert(pos1b);
+    assert(pos1b->better == pos1a);
+    sbuf[2] = 'b';
+    pos2a = redo_addposition(session, pos1a, 'b', sbuf, 0, redo_check);
+    assert(pos2a);
+    assert(pos2a->better == NULL);
+
+    /* Verify that the defaults can be restored. */
+
+    redo_setstatecallbacks(session, NULL, NULL, NULL);
+    sbuf[1] = 'a';
+    sbuf[2] = '.';
+    pos = redo_addposition(session, pos2a, 'a', sbuf, 0, redo_check);
+    assert(pos);
+    assert(pos->better == pos1a);
+    assert(callcount == 4);
+
+    teardown();
+}
+
+/* A canonicalizing function that treats the first two bytes of a
+ * state as interchangeable, by putting them in sorted order.
+ */
+static void sortfirstpair(void *canon, void const *state, int size,
+                          void *data)
+{
+    unsigned char *c = canon;
+
+    ++*(int*)data;
+    memcpy(canon, state, size);
+    if (c[0] > c[1]) {
+        c[0] = c[1];
+        c[1] = ((unsigned char const*)state)[0];
+    }
+}
+
+/* Verify that states with the same canonical form are treated as
+ * identical.
+ */
+static void test_canonicalstates(void)
+{
+    redo_position *posab, *posba, *pos;
+    int callcount;
+
+    setup();
+    memset(sbuf, '.', sizeof sbuf);
+
+    callcount = 0;
+    assert(redo_setcanonicalizer(session, sortfirstpair, &callcount));
+    assert(callcount == 1);
+
+    sbuf[0] = 'a';
+    sbuf[1] = 'b';
+    posab = redo_addposition(session, rootpos, 'a', sbuf, 0, redo_check);
+    assert(posab);
+    assert(posab->better == NULL);
+    sbuf[0] = 'b';
+    sbuf[1] = 'a';
+    posba = redo_addposition(session, posab, 'b', sbuf, 0, redo_check);
+    assert(posba);
+    assert(posba->better == posab);
+
+    /* Verify that only an exact return to a state is a cycle. */
+
+    pos = posab;
+    assert(!redo_suppresscycle(session, &pos, sbuf, 0));
+    assert(pos == posab);
+    sbuf[0] = 'a';
+    sbuf[1] = 'b';
+    pos = posba;
+    assert(redo_suppresscycle(session, &pos, sbuf, 0));
+    assert(pos == posab);
+    sbuf[0] = 'b';
+    sbuf[1] = 'a';
+
+    /* Verify that the stored state data is not canonicalized. */
+
+    pos = redo_addposition(session, rootpos, 'b', sbuf, 0, redo_nocheck);
+    assert(pos);
+    assert(!memcmp(redo_getsavedstate(pos), "ba", 2));
+
+    /* Verify that removing the function restores exact comparisons. */
+
+    callcount = 0;
+    assert(redo_setcanonicalizer(session, NULL, NULL));
+    sbuf[0] = 'b';
+    sbuf[1] = 'a';
+    pos = posab;
+    assert(!redo_suppresscycle(session, &pos, sbuf, 0));
+    assert(pos == posab);
+    assert(callcount == 0);
+
+    teardown();
+}
+
+/* Verify that a shorter route to a state that only shares its
+ * canonical form does not take over the moves of the longer one.
+ */
+static void test_canonicalgrafting(void)
+{
+    static int const behaviors[] = {
+        redo_graft, redo_copypath, redo_graftandcopy
+    };
+    redo_position *deep, *end, *shallow, *pos;
+    int callcount, i;
+
+    for (i = 0 ; i < (int)(sizeof behaviors / sizeof *behaviors) ; ++i) {
+        setup();
+        redo_setgraftbehavior(session, behaviors[i]);
+        callcount = 0;
+        assert(redo_setcanonicalizer(session, sortfirstpair, &callcount));
+        memset(sbuf, '.', sizeof sbuf);
+        sbuf[0] = 'x';
+        pos = redo_addposition(session, rootpos, 'x', sbuf, 0, redo_check);
+        assert(pos);
+        sbuf[0] = 'a';
+        sbuf[1] = 'b';
+        deep = redo_addposition(session, pos, 'a', sbuf, 0, redo_check);
+        assert(deep);
+        sbuf[2] = 'c';
+        end = redo_addposition(session, deep, 'c', sbuf, 1, redo_check);
+        assert(end);
+
+        sbuf[0] = 'b';
+        sbuf[1] = 'a';
+        sbuf[2] = '.';
+        shallow = redo_addposition(session, rootpos, 'b', sbuf, 0,
+                                   redo_check);
+        assert(shallow);
+        assert(shallow->better == NULL);
+        assert(deep->better == shallow);
+        assert(shallow->next == NULL && shallow->solutionend == 0);
+        assert(redo_getnextposition(deep, 'c') == end);
+        assert(end->prev == deep && end->movecount == 3);
+        assert(!redo_duplicatepath(session, shallow, deep));
+        assert(shallow->next == NULL);
+        teardown();
+    }
+}
+
+/* The size of the states used to test the storage modes, and how
+ * many of those bytes are comparing.
+ */
+#define SIZE_BIGSTATE 1000
+#define SIZE_BIGCMPSTATE 996
+
+/* Fill a buffer with the nth state in a sequence of large states, in
+ * which each state differs from the previous one by a single byte.
+ * The first two bytes never change.
+ */
+static void makebigstate(unsigned char *buf, int n)
+{
+    int i;
+
+    for (i = 0 ; i < SIZE_BIGCMPSTATE ; ++i)
+        buf[i] = (unsigned char)(i * 7);
+    for (i = 1 ; i <= n ; ++i)
+        buf[2 + (i * 37) % (SIZE_BIGCMPSTATE - 2)] += i;
+    memset(buf + SIZE_BIGCMPSTATE, n, SIZE_BIGSTATE - SIZE_BIGCMPSTATE);
+}
+
+/* Verify that every position in a line holds the expected state.
+ */
+static void checkbigstates(redo_position **line, int count)
+{
+    unsigned char buf[SIZE_BIGSTATE];
+    int i;
+
+    for (i = 0 ; i < count ; ++i) {
+        makebigstate(buf, i + 1);
+        assert(!memcmp(redo_getsavedstate(line[i]), buf, SIZE_BIGSTATE));
+    }
+}
+
+/* Verify that states stored as deltas are correctly reconstructed.
+ */
+static void test_deltastorage(void)
+{
+    unsigned char buf[SIZE_BIGSTATE];
+    redo_session *s;
+    redo_position *line[60];
+    redo_position *pos;
+    int callcount, i;
+
+    makebigstate(buf, 0);
+    s = redo_beginsession(buf, SIZE_BIGSTATE, SIZE_BIGCMPSTATE);
+    assert(s);
+    assert(redo_setstoragemode(s, redo_storedeltas, 4));
+    assert(!redo_setstoragemode(s, redo_storedeltas + 1, 0));
+    callcount = 0;
+    assert(redo_setcanonicalizer(s, sortfirstpair, &callcount));
+    assert(!memcmp(redo_getsavedstate(redo_getfirstposition(s)), buf,
+                   SIZE_BIGSTATE));
+
+    pos = redo_getfirstposition(s);
+    for (i = 0 ; i < 60 ; ++i) {
+        makebigstate(buf, i + 1);
+        pos = redo_addposition(s, pos, i, buf, 0, redo_check);
+        assert(pos);
+        assert(pos->better == NULL);
+        line[i] = pos;
+    }
+    checkbigstates(line, 60);
+    assert(!redo_setstoragemode(s, redo_storefull, 0));
+
+    /* Verify that a state is found when it matches a reconstructed
+     * state.
+     */
+
+    makebigstate(buf, 25);
+    pos = line[59];
+    assert(redo_suppresscycle(s, &pos, buf, 0));
+    assert(pos == line[24]);
+
+    /* Verify that changing a position's extra bytes does not affect
+     * the following positions.
+     */
+
+    makebigstate(buf, 11);
+    buf[SIZE_BIGSTATE - 1] = 99;
+    redo_updatesavedstate(s, line[10], buf);
+    assert(!memcmp(redo_getsavedstate(line[10]), buf, SIZE_BIGSTATE));
+    buf[SIZE_BIGSTATE - 1] = 11;
+    redo_updatesavedstate(s, line[10], buf);
+    checkbigstates(line, 60);
+
+    /* Verify that subtrees are grafted onto identical positions, but
+     * not onto merely equivalent ones.
+     */
+
+    makebigstate(buf, 20);
+    pos = redo_addposition(s, redo_getfirstposition(s), 100, buf, 0,
+                           redo_check);
+    assert(pos);
+    assert(line[19]->better == pos);
+    assert(redo_getnextposition(pos, 20) == line[20]);
+    checkbigstates(line, 60);
+    makebigstate(buf, 40);
+    buf[0] = buf[1];
+    buf[1] = 0;
+    pos = redo_addposition(s, redo_getfirstposition(s), 101, buf, 0,
+                           redo_check);
+    assert(pos);
+    assert(line[39]->better == pos);
+    assert(redo_getnextposition(pos, 40) == NULL);
+    assert(redo_getnextposition(line[39], 40) == line[40]);
+    checkbigstates(line, 60);
+
+    /* Verify that states survive compacting the session. */
+
+    for (i = 59 ; i >= 50 ; --i)
+        redo_dropposition(s, line[i]);
+    assert(redo_compactsession(s, line, 50));
+    checkbigstates(line, 50);
+
+    redo_endsession(s);
+}
+
+/* A move function for a game in which every move adds a value to one
+ * byte of the state. The move's low byte is the value to add, and the
+ * remaining bits select the byte.
+ */
+static void addtobyte(void *state, int size, int move, void *data)
+{
+    ++*(int*)data;
+    ((unsigned char*)state)[(move >> 8) % (size - 4)] += move & 0xFF;
+}
+
+/* Verify that states are correctly reconstructed by applying moves.
+ */
+static void test_keyframestorage(void)
+{
+    unsigned char buf[64];
+    redo_session *s;
+    redo_position *line[100];
+    redo_position *pos, *branch;
+    int callcount, i;
+
+    memset(buf, 0, sizeof buf);
+    s = redo_beginsession(buf, 64, 60);
+    assert(s);
+    assert(!redo_setstoragemode(s, redo_storekeyframes, 8));
+    callcount = 0;
+    assert(redo_setmovecallback(s, addtobyte, &callcount));
+    assert(redo_setstoragemode(s, redo_storekeyframes, 8));
+    assert(!redo_setmovecallback(s, NULL, NULL));
+
+    /* Build a line of positions, each of which adds one to the first
+     * byte, and verify that their states are recreated.
+     */
+
+    pos = redo_getfirstposition(s);
+    for (i = 0 ; i < 100 ; ++i) {
+        buf[0] = i + 1;
+        memset(buf + 60, i + 1, 4);
+        pos = redo_addposition(s, pos, 1, buf, 0, redo_check);
+        assert(pos);
+        line[i] = pos;
+    }
+    for (i = 0 ; i < 100 ; ++i) {
+        buf[0] = i + 1;
+        memset(buf + 60, i + 1, 4);
+        assert(!memcmp(redo_getsavedstate(line[i]), buf, sizeof buf));
+    }
+    callcount = 0;
+    redo_getsavedstate(line[99]);
+    assert(callcount > 0 && callcount <= 8);
+
+    /* Verify that a position becomes a keyframe when it acquires a
+     * second move.
+     */
+
+    buf[0] = 51;
+    buf[1] = 1;
+    memset(buf + 60, 0, 4);
+    branch = redo_addposition(s, line[50], 0x101, buf, 0, redo_check);
+    assert(branch);
+    callcount = 0;
+    assert(((unsigned char const*)redo_getsavedstate(line[50]))[0] == 51);
+    assert(callcount == 0);
+    assert(!memcmp(redo_getsavedstate(branch), buf, sizeof buf));
+
+    /* Verify that states are still recreated after a graft. */
+
+    buf[0] = 31;
+    buf[1] = 0;
+    pos = redo_addposition(s, redo_getfirstposition(s), 31, buf, 0,
+                           redo_check);
+    assert(pos);
+    assert(line[30]->better == pos);
+    assert(redo_getnextposition(pos, 1) == line[31]);
+    for (i = 0 ; i < 100 ; ++i) {
+        buf[0] = i + 1;
+        memset(buf + 60, i + 1, 4);
+        assert(!memcmp(redo_getsavedstate(line[i]), buf, sizeof buf));
+    }
+
+    redo_endsession(s);
+}
+
+/* Verify that positions with identical states share their state data.
+ */
+static void test_internedstorage(void)
+{
+    unsigned char buf[40];
+    redo_session *s;
+    redo_position *pos1, *pos2, *pos3;
+
+    /* Verify that identical states are stored only once. */
+
+    memset(buf, 0, sizeof buf);
+    s = redo_beginsession(buf, sizeof buf, 0);
+    assert(s);
+    assert(redo_setstoragemode(s, redo_storeinterned, 0));
+    redo_setgraftbehavior(s, redo_nograft);
+    buf[0] = 1;
+    pos1 = redo_addposition(s, redo_getfirstposition(s), 1, buf, 0,
+                            redo_check);
+    assert(pos1);
+    buf[0] = 2;
+    pos2 = redo_addposition(s, pos1, 2, buf, 0, redo_check);
+    assert(pos2);
+    pos3 = redo_addposition(s, redo_getfirstposition(s), 2, buf, 0,
+                            redo_check);
+    assert(pos3);
+    assert(pos2->better == pos3);
+    assert(redo_getsavedstate(pos2) == redo_getsavedstate(pos3));
+    assert(redo_getsavedstate(pos1) != redo_getsavedstate(pos3));
+
+    /* Verify that the state survives the deletion of either user. */
+
+    redo_dropposition(s, pos3);
+    assert(pos2->better == NULL);
+    assert(!memcmp(redo_getsavedstate(pos2), buf, sizeof buf));
+    pos3 = redo_addposition(s, redo_getfirstposition(s), 2, buf, 0,
+                            redo_check);
+    assert(pos3);
+    redo_dropposition(s, pos2);
+    assert(!memcmp(redo_getsavedstate(pos3), buf, sizeof buf));
+    redo_endsession(s);
+
+    /* Verify that the extra state data is kept separately. */
+
+    setup();
+    assert(redo_setstoragemode(session, redo_storeinterned, 0));
+    rootpos = redo_getfirstposition(session);
+    memset(sbuf, 'x', sizeof sbuf);
+    pos1 = redo_addposition(session, rootpos, 1, sbuf, 0, redo_nocheck);
+    assert(pos1);
+    sbuf[SIZE_CMPSTATE] = 'y';
+    pos2 = redo_addposition(session, rootpos, 2, sbuf, 0, redo_nocheck);
+    assert(pos2);
+    assert(((char const*)redo_getsavedstate(pos1))[SIZE_CMPSTATE] == 'x');
+    assert(((char const*)redo_getsavedstate(pos2))[SIZE_CMPSTATE] == 'y');
+    sbuf[SIZE_CMPSTATE] = 'z';
+    redo_updatesavedstate(session, pos1, sbuf);
+    assert(((char const*)redo_getsavedstate(pos1))[SIZE_CMPSTATE] == 'z');
+    assert(((char const*)redo_getsavedstate(pos2))[SIZE_CMPSTATE] == 'y');
+    teardown();
+}
+
+/* Verify that states stored apart from their positions remain intact
+ * as the session changes.
+ */
+static void test_separatestorage(void)
+{
+    redo_position *line[300];
+    redo_position *pos;
+    void const *state;
+    int i;
+
+    setup();
+    assert(redo_setstoragemode(session, redo_storeseparate, 0));
+    redo_setgraftbehavior(session, redo_nograft);
+    rootpos = redo_getfirstposition(session);
+    assert(!memcmp(redo_getsavedstate(rootpos), sbuf, SIZE_STATE));
+
+    /* Build a line of positions, spanning several chunks. */
+
+    pos = rootpos;
+    for (i = 0 ; i < 300 ; ++i) {
+        memset(sbuf, i + 1, sizeof sbuf);
+        pos = redo_addposition(session, pos, i, sbuf, 0, redo_check);
+        assert(pos);
+        line[i] = pos;
+    }
+
+    /* Verify that the saved state pointers stay valid, and that the
+     * extra bytes can be updated.
+     */
+
+    state = redo_getsavedstate(line[0]);
+    assert(redo_getsavedstate(line[1]) != state);
+    assert(((char const*)state)[0] == 1);
+    memset(sbuf, 1, sizeof sbuf);
+    sbuf[SIZE_CMPSTATE] = 'x';
+    redo_updatesavedstate(session, line[0], sbuf);
+    assert(redo_getsavedstate(line[0]) == state);
+    assert(!memcmp(state, sbuf, SIZE_STATE));
+
+    /* Verify that states are found, and that reused elements get the
+     * correct state.
+     */
+
+    memset(sbuf, 150, sizeof sbuf);
+    pos = redo_addposition(session, rootpos, -1, sbuf, 0, redo_check);
+    assert(pos && line[149]->better == pos);
+    redo_dropposition(session, pos);
+    redo_dropposition(session, line[299]);
+    memset(sbuf, 'z', sizeof sbuf);
+    pos = redo_addposition(session, line[298], 299, sbuf, 0, redo_check);
+    assert(pos);
+    line[299] = pos;
+    assert(!memcmp(redo_getsavedstate(pos), sbuf, SIZE_STATE));
+    assert(((char const*)redo_getsavedstate(line[298]))[0] == 299 % 256);
+
+    /* Verify that compaction carries the states along. */
+
+    assert(redo_compactsession(session, line, 300));
+    assert(redo_getsessionsize(session) == 301);
+    for (i = 0 ; i < 299 ; ++i) {
+        state = redo_getsavedstate(line[i]);
+        assert(((char const*)state)[0] == (char)(i + 1));
+        assert(((char const*)state)[SIZE_CMPSTATE] ==
+                                        (i ? (char)(i + 1) : 'x'));
+        assert(redo_getnextposition(line[i], i + 1) == line[i + 1]);
+    }
+    assert(!memcmp(redo_getsavedstate(line[299]), sbuf, SIZE_STATE));
+
+    /* Verify that the session can be switched back to full storage. */
+
+    teardown();
+    setup();
+    assert(redo_setstoragemode(session, redo_storeseparate, 0));
+    assert(redo_setstoragemode(session, redo_storefull, 0));
+    assert(!memcmp(redo_getsavedstate(redo_getfirstposition(session)),
+                   sbuf, SIZE_STATE));
+    teardown();
+}
+
+/* The bookkeeping for a test allocator: the number of blocks
+ * currently allocated, and the number of allocations remaining
+ * before the allocator starts failing.
+ */
+struct allocstats {
+    int live;
+    int remaining;
+};
+
+/* An allocator that keeps count of its blocks, and which fails once
+ * its allowance of allocations is used up.
+ */
+static void *countingalloc(size_t size, void *context)
+{
+    struct allocstats *stats = context;
+
+    if (!stats->remaining)
+        return NULL;
+    --stats->remaining;
+    ++stats->live;
+    return malloc(size);
+}
+
+static void countingfree(void *ptr, void *context)
+{
+    struct allocstats *stats = context;
+
+    assert(ptr);
+    --stats->live;
+    free(ptr);
+}
+
+/* Verify that a session's memory all comes from, and is all returned
+ * to, the caller's allocation functions.
+ */
+static void test_allocator(void)
+{
+    struct allocstats stats;
+    redo_position *line[2000];
+    redo_position *pos;
+    redo_session *s;
+    int callcount, i;
+
+    /* Exercise every kind of allocation in a session. */
+
+    stats.live = 0;
+    stats.remaining = -1;
+    memset(sbuf, 0, sizeof sbuf);
+    s = redo_beginsessionalloc(sbuf, SIZE_STATE, SIZE_CMPSTATE,
+                               countingalloc, countingfree, &stats);
+    assert(s);
+    assert(stats.live > 0);
+    assert(redo_setstoragemode(s, redo_storedeltas, 0));
+    callcount = 0;
+    assert(redo_setcanonicalizer(s, sortfirstpair, &callcount));
+    pos = redo_getfirstposition(s);
+    for (i = 0 ; i < 2000 ; ++i) {
+        sbuf[i % 4] = (char)(i / 4 + 1);
+        pos = redo_addposition(s, pos, i, sbuf, 0, redo_check);
+        assert(pos);
+        line[i] = pos;
+    }
+    for (i = 1999 ; i >= 1000 ; --i)
+        assert(redo_dropposition(s, line[i]));
+    assert(redo_getsessionsize(s) == 1001);
+    assert(redo_compactsession(s, NULL, 0));
+    assert(redo_getsessionsize(s) == 1001);
+    redo_endsession(s);
+    assert(stats.live == 0);
+
+    /* Verify that allocation failures during session creation are
+     * handled cleanly, wherever they occur.
+     */
+
+    for (i = 0 ; i < 8 ; ++i) {
+        stats.live = 0;
+        stats.remaining = i;
+        s = redo_beginsessionalloc(sbuf, SIZE_STATE, 0,
+                                   countingalloc, countingfree, &stats);
+        if (s) {
+            assert(redo_getsessionsize(s) == 1);
+            redo_endsession(s);
+        }
+        assert(stats.live == 0);
+    }
+
+    /* Verify that a failing allocator makes additions fail. */
+
+    stats.live = 0;
+    stats.remaining = -1;
+    s = redo_beginsessionalloc(sbuf, SIZE_STATE, 0,
+                               countingalloc, countingfree, &stats);
+    assert(s);
+    stats.remaining = 0;
+    pos = redo_getfirstposition(s);
+    for (i = 0 ; i < 1000 && pos ; ++i) {
+        sbuf[0] = (char)i;
+        sbuf[1] = (char)(i >> 8);
+        pos = redo_addposition(s, pos, i, sbuf, 0, redo_check);
+    }
+    assert(!pos);
+    redo_endsession(s);
+    assert(stats.live == 0);
+
+    /* Verify that NULL functions select the standard allocator. */
+
+    s = redo_beginsessionalloc(sbuf, SIZE_STATE, 0, NULL, countingfree,
+                               &stats);
+    assert(s);
+    redo_endsession(s);
+    assert(stats.live == 0);
+}
+
+/* An allocator that refuses its second request, which is the one for
+ * a new session's hash table.
+ */
+static void *nohashtablealloc(size_t size, void *context)
+{
+    return ++*(int*)context == 2 ? NULL : malloc(size);
+}
+
+static void plainfree(void *ptr, void *context)
+{
+    (void)context;
+    free(ptr);
+}
+
+/* Verify that positions stay linked correctly as they come and go,
+ * with and without a hash table.
+ */
+static void test_positionindices(void)
+{
+    redo_position *line[500];
+    redo_position *pos;
+    redo_session *s;
+    int callcount, pass, i;
+
+    for (pass = 0 ; pass < 2 ; ++pass) {
+        callcount = pass ? 0 : 2;
+        memset(sbuf, 0, sizeof sbuf);
+        s = redo_beginsessionalloc(sbuf, SIZE_STATE, 0, nohashtablealloc,
+                                   plainfree, &callcount);
+        assert(s);
+        redo_setgraftbehavior(s, redo_nograft);
+
+        /* Build a line of positions, delete every other one from the
+         * end, and then add them back in a different order.
+         */
+
+        pos = redo_getfirstposition(s);
+        for (i = 0 ; i < 500 ; ++i) {
+            sbuf[0] = (char)(i + 1);
+            sbuf[1] = (char)(i / 200);
+            pos = redo_addposition(s, pos, i, sbuf, 0, redo_check);
+            assert(pos);
+            line[i] = pos;
+        }
+        for (i = 499 ; i >= 250 ; --i)
+            assert(redo_dropposition(s, line[i]) == line[i - 1]);
+        pos = line[249];
+        for (i = 250 ; i < 500 ; ++i) {
+            sbuf[0] = (char)(i + 1);
+            sbuf[1] = (char)(i / 200);
+            pos = redo_addposition(s, pos, i, sbuf, 0, redo_check);
+            assert(pos);
+            line[i] = pos;
+        }
+
+        /* Verify that every state can still be found, before and
+         * after compacting the session.
+         */
+
+        assert(redo_compactsession(s, line, 500));
+        for (i = 0 ; i < 500 ; ++i) {
+            sbuf[0] = (char)(i + 1);
+            sbuf[1] = (char)(i / 200);
+            pos = redo_addposition(s, redo_getfirstposition(s), -1 - i,
+                                   sbuf, 0, redo_check);
+            assert(pos);
+            assert(line[i]->better == pos || pos->better == line[i]);
+            redo_dropposition(s, pos);
+        }
+        redo_endsession(s);
+    }
+
+    /* Verify that hash values are stored intact alongside the packed
+     * index and flags.
+     */
+
+    setup();
+    memset(sbuf, 'x', sizeof sbuf);
+    pos = redo_addpositionhashed(session, rootpos, 1, sbuf, 0xFC000123, 0,
+                                 redo_check);
+    assert(pos);
+    sbuf[0] = 'y';
+    pos = redo_addpositionhashed(session, pos, 2, sbuf, 0x00000456, 0,
+                                 redo_check);
+    assert(pos);
+    sbuf[0] = 'x';
+    assert(redo_suppresscyclehashed(session, &pos, sbuf, 0xFC000123, 0));
+    assert(pos->movecount == 1);
+    teardown();
+}
+
+/* The size of the states used to test sessions with states that are
+ * too large to be described by 16 bits.
+ */
+#define SIZE_HUGESTATE (200 * 1024)
+
+/* Verify that very large states work in each storage mode, including
+ * changes that lie more than 64k bytes apart.
+ */
+static void test_hugestates(void)
+{
+    static int const modes[] = { redo_storefull, redo_storedeltas,
+                                 redo_storeinterned, redo_storeseparate };
+    redo_position *line[20];
+    unsigned char const *state;
+    unsigned char *buf;
+    redo_session *s;
+    redo_position *pos;
+    int m, i;
+
+    buf = malloc(SIZE_HUGESTATE);
+    assert(buf);
+    for (m = 0 ; m < (int)(sizeof modes / sizeof *modes) ; ++m) {
+        memset(buf, 0, SIZE_HUGESTATE);
+        s = redo_beginsession(buf, SIZE_HUGESTATE, 0);
+        assert(s);
+        assert(redo_setstoragemode(s, modes[m], 0));
+        redo_setgraftbehavior(s, redo_nograft);
+        pos = redo_getfirstposition(s);
+        for (i = 0 ; i < 20 ; ++i) {
+            buf[i * 9973] = i + 1;
+            buf[SIZE_HUGESTATE - 1] = i;
+            pos = redo_addposition(s, pos, i, buf, 0, redo_check);
+            assert(pos);
+            line[i] = pos;
+        }
+        for (i = 0 ; i < 20 ; ++i) {
+            state = redo_getsavedstate(line[i]);
+            assert(state[i * 9973] == i + 1);
+            assert(state[SIZE_HUGESTATE - 1] == i);
+            assert(i == 19 || state[(i + 1) * 9973] == 0);
+        }
+
+        /* A state that differs only in its last byte is distinct. */
+
+        memcpy(buf, redo_getsavedstate(line[9]), SIZE_HUGESTATE);
+        pos = redo_addposition(s, redo_getfirstposition(s), -1, buf, 0,
+                               redo_check);
+        assert(pos && line[9]->better == pos);
+        buf[SIZE_HUGESTATE - 1] ^= 0x80;
+        pos = redo_addposition(s, pos, -1, buf, 0, redo_check);
+        assert(pos && !pos->better);
+        assert(redo_getsessionsize(s) == 23);
+        redo_endsession(s);
+    }
+    free(buf);
+}
+
+/* The header that sizedalloc() places in front of each block.
+ */
+union sizedheader {
+    size_t size;
+    void *align;
+};
+
+/* An allocator that keeps a running total of the bytes it has handed
+ * out and not yet had returned.
+ */
+static void *sizedalloc(size_t size, void *context)
+{
+    union sizedheader *block;
+
+    block = malloc(sizeof *block + size);
+    if (!block)
+        return NULL;
+    block->size = size;
+    *(size_t*)context += size;
+    return block + 1;
+}
+
+static void sizedfree(void *ptr, void *context)
+{
+    union sizedheader *block = (union sizedheader*)ptr - 1;
+
+    *(size_t*)context -= block->size;
+    free(block);
+}
+
+/* Verify that the reported memory statistics account for exactly the
+ * memory that the session holds, in each storage mode.
+ */
+static void test_memorystats(void)
+{
+    static int const modes[] = { redo_storefull, redo_storedeltas,
+                                 redo_storeinterned, redo_storeseparate };
+    redo_position *line[1000];
+    redo_memorystats stats;
+    redo_session *s;
+    redo_position *pos;
+    size_t live;
+    int callcount, m, i;
+
+    for (m = 0 ; m < (int)(sizeof modes / sizeof *modes) ; ++m) {
+        live = 0;
+        memset(sbuf, 0, sizeof sbuf);
+        s = redo_beginsessionalloc(sbuf, SIZE_STATE, SIZE_CMPSTATE,
+                                   sizedalloc, sizedfree, &live);
+        assert(s);
+        assert(redo_setstoragemode(s, modes[m], 0));
+        redo_getmemorystats(s, &stats);
+        assert(stats.totalbytes == live);
+        assert(stats.positionslots == stats.freepositions + 1);
+        assert(stats.positionusedbytes == (size_t)stats.positionsize);
+        assert(stats.positionsize >= (int)(sizeof(redo_position) +
+                                           sizeof(redo_branch)));
+
+        /* Fill the session, and then delete half of it. */
+
+        if (modes[m] == redo_storedeltas) {
+            callcount = 0;
+            assert(redo_setcanonicalizer(s, sortfirstpair, &callcount));
+        }
+        pos = redo_getfirstposition(s);
+        for (i = 0 ; i < 1000 ; ++i) {
+            sbuf[i % 4] = (char)(i / 4 + 1);
+            pos = redo_addposition(s, i % 3 ? pos : redo_getfirstposition(s),
+                                   i, sbuf, 0, redo_check);
+            assert(pos);
+            line[i] = pos;
+        }
+        redo_getmemorystats(s, &stats);
+        assert(stats.totalbytes == live);
+        assert(stats.positionslots - stats.freepositions == 1001);
+        assert(stats.positionusedbytes == 1001 * (size_t)stats.positionsize);
+        assert(modes[m] == redo_storefull || modes[m] == redo_storeseparate
+                                          || stats.statebytes > 0);
+        for (i = 999 ; i >= 500 ; --i)
+            assert(redo_dropposition(s, line[i]));
+        redo_getmemorystats(s, &stats);
+        assert(stats.totalbytes == live);
+        assert(stats.positionslots - stats.freepositions == 501);
+        assert(stats.positionfragmentation >= 40);
+
+        /* Verify that compaction reclaims the unused slots. */
+
+        assert(redo_compactsession(s, NULL, 0));
+        redo_getmemorystats(s, &stats);
+        assert(stats.totalbytes == live);
+        assert(stats.positionchunks == 1 && stats.freepositions == 1);
+        assert(stats.positionfragmentation == 0);
+        redo_endsession(s);
+        assert(live == 0);
+    }
+}
+
+/* Return the memory in use by the test session, as it is measured
+ * against the session's memory limit.
+ */
+static size_t getmemoryinuse(void)
+{
+    redo_memorystats stats;
+
+    redo_getmemorystats(session, &stats);
+    return stats.totalbytes - (stats.positionbytes - stats.positionusedbytes);
+}
+
+/* Verify that a session with a memory limit discards the positions
+ * that have gone unvisited, while keeping solutions and positions
+ * that are visited regularly.
+ */
+static void test_memorylimit(void)
+{
+    redo_position *hot[10], *solution[10];
+    redo_memorystats stats;
+    redo_position *pos, *line;
+    size_t limit;
+    int round, size, i, n;
+
+    setup();
+    redo_setgraftbehavior(session, redo_nograft);
+    pos = rootpos;
+    for (i = 0 ; i < 10 ; ++i) {
+        n = i + 1;
+        memcpy(sbuf, &n, sizeof n);
+        pos = redo_addposition(session, pos, i, sbuf, 0, redo_check);
+        assert(pos);
+        hot[i] = pos;
+    }
+    pos = rootpos;
+    for (i = 0 ; i < 10 ; ++i) {
+        n = i + 101;
+        memcpy(sbuf, &n, sizeof n);
+        pos = redo_addposition(session, pos, i + 100, sbuf, i == 9,
+                               redo_check);
+        assert(pos);
+        solution[i] = pos;
+    }
+    redo_getmemorystats(session, &stats);
+    limit = getmemoryinuse() + 200 * stats.positionsize;
+    assert(redo_setmemorylimit(session, limit) == 0);
+
+    /* Each round revisits the hot branch and explores a new one. */
+
+    for (round = 0 ; round < 100 ; ++round) {
+        pos = rootpos;
+        for (i = 0 ; i < 10 ; ++i) {
+            pos = redo_getnextposition(pos, i);
+            assert(pos == hot[i]);
+        }
+        pos = rootpos;
+        for (i = 0 ; i < 20 ; ++i) {
+            n = 1000 + round * 20 + i;
+            memcpy(sbuf, &n, sizeof n);
+            pos = redo_addposition(session, pos, i ? i : 1000 + round,
+                                   sbuf, 0, redo_check);
+            assert(pos);
+            assert(!memcmp(redo_getsavedstate(pos), sbuf, SIZE_STATE));
+            assert(getmemoryinuse() <= limit);
+        }
+    }
+    assert(redo_getsessionsize(session) <= 221);
+    pos = rootpos;
+    for (i = 0 ; i < 10 ; ++i) {
+        pos = redo_getnextposition(pos, i + 100);
+        assert(pos == solution[i]);
+    }
+    assert(rootpos->solutionend == 1 && rootpos->solutionsize == 10);
+
+    /* Verify that removing the limit stops the deletions. */
+
+    assert(redo_setmemorylimit(session, 0) == limit);
+    n = redo_getsessionsize(session);
+    pos = rootpos;
+    for (i = 0 ; i < 300 ; ++i) {
+        memcpy(sbuf, &i, sizeof i);
+        sbuf[SIZE_CMPSTATE - 1] = 1;
+        pos = redo_addposition(session, pos, i + 5000, sbuf, 0, redo_check);
+        assert(pos);
+    }
+    assert(redo_getsessionsize(session) == n + 300);
+
+    /* Verify that a session that cannot get under its limit goes on
+     * growing along a line, and that the end of the line is deleted
+     * once another move branches off before it.
+     */
+
+    redo_setmemorylimit(session, 1);
+    line = NULL;
+    for (i = 0 ; i < 2000 ; ++i) {
+        n = 100000 + i;
+        memcpy(sbuf, &n, sizeof n);
+        sbuf[SIZE_CMPSTATE - 1] = 2;
+        line = redo_addposition(session, line ? line : rootpos,
+                                i ? 0 : 7000, sbuf, 0, redo_check);
+        assert(line);
+        if (i == 0)
+            size = redo_getsessionsize(session);
+    }
+    assert(redo_getsessionsize(session) == size + 1999);
+    pos = line->prev;
+    n = 200000;
+    memcpy(sbuf, &n, sizeof n);
+    assert(redo_addposition(session, pos, 1, sbuf, 0, redo_check));
+    assert(redo_getnextposition(pos, 0) == NULL);
+    assert(pos->nextcount == 1);
+    teardown();
+}
+
+/* Verify that a position left behind by a graft is deleted ahead of
+ * more recently visited ones, even when the session had previously
+ * found nothing that it could delete.
+ */
+static void test_memorylimitgraft(void)
+{
+    redo_position *line[42];
+    redo_position *side, *pos;
+    int i, n;
+
+    setup();
+    memset(sbuf, 0, sizeof sbuf);
+    n = 1;
+    memcpy(sbuf, &n, sizeof n);
+    side = redo_addposition(session, rootpos, 1, sbuf, 0, redo_check);
+    assert(side);
+    n = 2;
+    memcpy(sbuf, &n, sizeof n);
+    pos = redo_addposition(session, side, 0, sbuf, 0, redo_check);
+    assert(pos);
+    n = 3;
+    memcpy(sbuf, &n, sizeof n);
+    assert(redo_addposition(session, pos, 0, sbuf, 1, redo_check));
+    for (i = 0 ; i < 42 ; ++i) {
+        n = 100 + i;
+        memcpy(sbuf, &n, sizeof n);
+        line[i] = redo_addposition(session, i ? line[i - 1] : rootpos,
+                                   i ? 0 : 2, sbuf, 0, redo_check);
+        assert(line[i]);
+        if (i == 40)
+            redo_setmemorylimit(session, getmemoryinuse());
+    }
+
+    /* Nothing could be deleted to make room for line[41]. Revisit
+     * it, and then reach the side branch's state by a shorter route,
+     * which grafts the solution away from it and leaves it deletable.
+     */
+
+    assert(redo_getsessionsize(session) == 46);
+    assert(redo_getnextposition(line[40], 0) == line[41]);
+    n = 2;
+    memcpy(sbuf, &n, sizeof n);
+    pos = redo_addposition(session, rootpos, 3, sbuf, 0, redo_check);
+    assert(pos);
+    assert(pos->next && pos->solutionend == 1);
+    assert(redo_getnextposition(rootpos, 1) == NULL);
+    assert(redo_getnextposition(line[40], 0) == line[41]);
+    teardown();
+}
+
+/* Verify that the solution bookkeeping survives a line of play as
+ * long as the position counts allow, and that the line can be grafted
+ * and taken apart again. With 16-bit counts, the line runs up to the
+ * limit, and a further move is refused rather than wrapping around.
+ */
+static void test_deeplines(void)
+{
+    redo_position **line;
+    redo_position *pos;
+    int depth, graftpoint, i, n;
+
+    depth = sizeof(redo_count) > 2 ? 300000 : 0xFFFF;
+    graftpoint = depth / 3 * 2;
+    line = malloc((depth + 1) * sizeof *line);
+    assert(line);
+    setup();
+    line[0] = rootpos;
+    for (i = 1 ; i <= depth ; ++i) {
+        memcpy(sbuf, &i, sizeof i);
+        line[i] = redo_addposition(session, line[i - 1], 0, sbuf, i == depth,
+                                   redo_check);
+        assert(line[i]);
+    }
+    assert((int)line[depth]->movecount == depth);
+    assert((int)rootpos->solutionsize == depth);
+    assert(line[graftpoint]->solutionend == 1);
+    if (sizeof(redo_count) == 2) {
+        n = depth + 1;
+        memcpy(sbuf, &n, sizeof n);
+        assert(!redo_addposition(session, line[depth], 0, sbuf, 0,
+                                 redo_check));
+        assert(redo_getsessionsize(session) == depth + 1);
+    }
+
+    /* Reach a deep position directly, grafting the rest of the line. */
+
+    memcpy(sbuf, &graftpoint, sizeof graftpoint);
+    pos = redo_addposition(session, rootpos, 1, sbuf, 0, redo_check);
+    assert(pos && pos->movecount == 1);
+    assert(line[graftpoint]->better == pos && !line[graftpoint]->next);
+    assert((int)line[depth]->movecount == depth - graftpoint + 1);
+    assert((int)rootpos->solutionsize == depth - graftpoint + 1);
+    assert((int)line[1]->solutionsize == 0);
+
+    /* Take the grafted line apart from the end. */
+
+    line[graftpoint] = pos;
+    for (i = depth ; i > graftpoint ; --i)
+        assert(redo_dropposition(session, line[i]) == line[i - 1]);
+    assert(rootpos->solutionend == 0 && !pos->next);
+    assert(redo_getsessionsize(session) == graftpoint + 2);
+    teardown();
+    free(line);
+}
+
+/* Verify the library's hash function on a large state, at various
+ * alignments.
+ */
+static void test_hashing(void)
+{
+    unsigned char *buf;
+    redo_session *s;
+    redo_position *pos;
+    int const size = 1000;
+    int i;
+
+    buf = malloc(size + 8);
+    assert(buf);
+    for (i = 0 ; i < size + 8 ; ++i)
+        buf[i] = (unsigned char)((i * 131 + 7) ^ (i >> 3));
+
+    /* Verify that the result doesn't depend on the available SIMD
+     * instructions, nor on the alignment of the state data.
+     */
+
+    assert(redo_hashstate(buf, size) == 0xB8138C44);
+    for (i = 1 ; i < 8 ; ++i) {
+        memmove(buf + i, buf + i - 1, size);
+        assert(redo_hashstate(buf + i, size) == 0xB8138C44);
+    }
+
+    /* Verify that large states are recognized as identical. */
+
+    s = redo_beginsession(buf + 7, size, 0);
+    assert(s);
+    buf[7 + size - 1] ^= 1;
+    pos = redo_addposition(s, redo_getfirstposition(s), 1, buf + 7, 0,
+                           redo_check);
+    assert(pos);
+    assert(pos->better == NULL);
+    buf[7 + size - 1] ^= 1;
+    pos = redo_addposition(s, pos, 1, buf + 7, 0, redo_check);
+    assert(pos);
+    assert(pos->better == redo_getfirstposition(s));
+    redo_endsession(s);
+
+    free(buf);
+}
+
+/* Verify that redo_setbetterfields() resolves many positions sharing
+ * the same few states.
+ */
+static void test_setbetterfields(void)
+{
+    redo_position *line[50];
+    redo_position *pos;
+    int i;
+
+    setup();
+    memset(sbuf, 0, sizeof sbuf);
+
+    /* Build a line of positions that cycles through five states. */
+
+    pos = rootpos;
+    for (i = 0 ; i < 50 ; ++i) {
+        sbuf[0] = (i + 1) % 5;
+        pos = redo_addposition(session, pos, i, sbuf, 0, redo_checklater);
+        assert(pos);
+        assert(pos->setbetter);
+        line[i] = pos;
+    }
+
+    /* Verify that each position points to the earliest one with its
+     * state (or to the root position).
+     */
+
+    assert(redo_setbetterfields(session) == 46);
+    assert(rootpos->better == NULL);
+    for (i = 0 ; i < 50 ; ++i) {
+        assert(!line[i]->setbetter);
+        if (i < 4)
+            assert(line[i]->better == NULL);
+        else if (i % 5 == 4)
+            assert(line[i]->better == rootpos);
+        else
+            assert(line[i]->better == line[i % 5]);
+    }
+
+    teardown();
+}
+
+/* Verify that equivalence classes keep a single representative, and
+ * that the paths to it are compressed.
+ */
+static void test_equivclasses(void)
+{
+    redo_position *line[10];
+    redo_position *pos, *rep;
+    int i, n;
+
+    setup();
+    redo_setgraftbehavior(session, redo_nograft);
+    memset(sbuf, 0, sizeof sbuf);
+
+    /* Build ten positions with the same state, linked in one long
+     * chain of better fields.
+     */
+
+    for (i = 0 ; i < 10 ; ++i) {
+        sbuf[0] = i + 1;
+        pos = redo_addposition(session, rootpos, i, sbuf, 0, redo_nocheck);
+        assert(pos);
+        sbuf[0] = 100;
+        line[i] = redo_addposition(session, pos, 0, sbuf, 0, redo_nocheck);
+        assert(line[i]);
+        assert(line[i]->better == NULL);
+    }
+    for (i = 0 ; i < 9 ; ++i)
+        line[i]->better = line[i + 1];
+
+    /* Verify that adding a position closer to the root makes it the
+     * representative of every member of the class.
+     */
+
+    pos = redo_addposition(session, rootpos, 10, sbuf, 0, redo_check);
+    assert(pos);
+    assert(pos->better == NULL);
+    assert(line[9]->better == pos);
+    for (i = 0 ; i < 9 ; ++i) {
+        for (rep = line[i] ; rep->better ; rep = rep->better) ;
+        assert(rep == pos);
+    }
+
+    /* Verify that deleting the representative elects a new one. */
+
+    redo_dropposition(session, pos);
+    assert(line[9]->better == NULL);
+    redo_dropposition(session, line[9]);
+    rep = NULL;
+    n = 0;
+    for (i = 0 ; i < 9 ; ++i) {
+        if (!line[i]->better) {
+            rep = line[i];
+            ++n;
+        }
+    }
+    assert(n == 1);
+    for (i = 0 ; i < 9 ; ++i)
+        assert(line[i] == rep || line[i]->better == rep);
+
+    teardown();
+}
+
+/* A state comparison function that counts how many times it is
+ * called.
+ */
+static int countingcompare(void const *state1, void const *state2,
+                           int size, void *data)
+{
+    ++*(int*)data;
+    return memcmp(state1, state2, size);
+}
+
+/* A hash function that agrees with countingcompare().
+ */
+static unsigned int plainhash(void const *state, int size, void *data)
+{
+    (void)data;
+    return redo_hashstate(state, size);
+}
+
+/* Verify that adding another transposition of a state compares it
+ * with only one member of its class, however large the class grows.
+ */
+static void test_manytranspositions(void)
+{
+    redo_position *first, *pos;
+    int callcount, i;
+
+    setup();
+    redo_setgraftbehavior(session, redo_nograft);
+    callcount = 0;
+    redo_setstatecallbacks(session, plainhash, countingcompare, &callcount);
+    memset(sbuf, 0, sizeof sbuf);
+
+    first = NULL;
+    for (i = 0 ; i < 2000 ; ++i) {
+        sbuf[0] = 1;
+        sbuf[1] = i % 200;
+        sbuf[2] = i / 200;
+        pos = redo_addposition(session, rootpos, i, sbuf, 0, redo_check);
+        assert(pos);
+        memset(sbuf, 0, 3);
+        sbuf[3] = 1;
+        callcount = 0;
+        pos = redo_addposition(session, pos, 0, sbuf, 0, redo_check);
+        assert(pos);
+        assert(callcount <= 1);
+        if (!first)
+            first = pos;
+        else
+            assert(pos->better == first);
+    }
+
+    teardown();
+}
+
+/* Verify that positions can be allocated in chunks of
+ * varying sizes.
+ */
+static void test_chunksizes(void)
+{
+    redo_position *line[200];
+    redo_position *pos;
+    int i;
+
+    setup();
+    memset(sbuf, 0, sizeof sbuf);
+
+    /* Verify that the chunk size can only be set to sensible values. */
+
+    redo_setchunksize(session, 2);
+    assert(redo_setchunksize(session, 1) == 2);
+    assert(redo_setchunksize(session, 0x1000001) == 2);
+
+    /* Build a line of positions, which will be spread across chunks
+     * that start out tiny and grow with each allocation.
+     */
+
+    pos = rootpos;
+    for (i = 0 ; i < 200 ; ++i) {
+        sbuf[0] = i + 1;
+        sbuf[1] = i + 2;
+        pos = redo_addposition(session, pos, i, sbuf, 0, redo_check);
+        assert(pos);
+        line[i] = pos;
+    }
+    assert(redo_setchunksize(session, 0) > 2);
+    assert(redo_getsessionsize(session) == 201);
+
+    /* Verify that every position is intact. */
+
+    for (i = 0 ; i < 200 ; ++i) {
+        sbuf[0] = i + 1;
+        sbuf[1] = i + 2;
+        assert((int)line[i]->movecount == i + 1);
+        assert(line[i]->better == NULL);
+        assert(!memcmp(redo_getsavedstate(line[i]), sbuf, SIZE_STATE));
+        assert(redo_getnextposition(line[i], i + 1) ==
+                                            (i < 199 ? line[i + 1] : NULL));
+    }
+
+    teardown();
+}
+
+/* Verify that compacting a session preserves its contents.
+ */
+static void test_compactsession(void)
+{
+    redo_position *line[100];
+    redo_position *pos, *equiv;
+    int i;
+
+    setup();
+    redo_setgraftbehavior(session, redo_nograft);
+    memset(sbuf, 0, sizeof sbuf);
+
+    /* Build a line of positions, each with a leaf hanging off of it,
+     * and then delete most of the leaves.
+     */
+
+    pos = rootpos;
+    for (i = 0 ; i < 100 ; ++i) {
+        sbuf[0] = i + 1;
+        sbuf[1] = 0;
+        pos = redo_addposition(session, pos, i, sbuf, 0, redo_check);
+        assert(pos);
+        line[i] = pos;
+        sbuf[1] = 1;
+        assert(redo_addposition(session, pos, -1, sbuf, 0, redo_check));
+    }
+    for (i = 0 ; i < 100 ; ++i)
+        if (i % 10)
+            redo_dropposition(session, redo_getnextposition(line[i], -1));
+    sbuf[0] = 50;
+    sbuf[1] = 0;
+    equiv = redo_addposition(session, line[10], 100, sbuf, 0, redo_check);
+    assert(equiv);
+    assert(line[49]->better == equiv);
+    assert(redo_getsessionsize(session) == 112);
+
+    /* Verify that an invalid array of pointers is rejected, and
+     * nothing is moved.
+     */
+
+    pos = line[99];
+    assert(!redo_compactsession(session, line, -1));
+    assert(!redo_compactsession(session, NULL, 1));
+    assert(line[99] == pos);
+    assert(redo_getnextposition(line[98], 99) == pos);
+
+    /* Verify that the positions are moved, and the caller's pointers
+     * updated to follow them.
+     */
+
+    assert(redo_compactsession(session, line, 100));
+    assert(line[99] != pos);
+    assert(redo_getsessionsize(session) == 112);
+    rootpos = redo_getfirstposition(session);
+    assert(rootpos->prev == NULL);
+
+    /* Verify that the tree's structure is intact. */
+
+    pos = rootpos;
+    for (i = 0 ; i < 100 ; ++i) {
+        assert(redo_getnextposition(pos, i) == line[i]);
+        assert(line[i]->prev == pos);
+        assert((int)line[i]->movecount == i + 1);
+        assert(((char const*)redo_getsavedstate(line[i]))[0] == i + 1);
+        assert((int)line[i]->nextcount == (i % 10 ? 1 : 2) + (i == 10) -
+                                                               (i == 99));
+        pos = line[i];
+    }
+    equiv = redo_getnextposition(line[10], 100);
+    assert(equiv);
+    assert(equiv->prev == line[10]);
+    assert(line[49]->better == equiv);
+
+    /* Verify that states can still be looked up, and that the session
+     * can continue to grow and shrink.
+     */
+
+    sbuf[0] = 30;
+    sbuf[1] = 0;
+    pos = line[99];
+    assert(redo_suppresscycle(session, &pos, sbuf, 0));
+    assert(pos == line[29]);
+    pos = line[99];
+    for (i = 0 ; i < 100 ; ++i) {
+        sbuf[0] = i + 1;
+        sbuf[1] = 2;
+        pos = redo_addposition(session, pos, 0, sbuf, 0, redo_check);
+        assert(pos);
+    }
+    assert(redo_getsessionsize(session) == 212);
+    redo_dropposition(session, pos);
+    assert(redo_getsessionsize(session) == 211);
+
+    teardown();
+}
+
+/* Verify that the next list of a position is intact and holds the
+ * expected number of branches.
+ */
+static void checknextlist(redo_position *position)
+{
+    redo_branch *branch;
+    unsigned long count;
+
+    count = 0;
+    for (branch = position->next ; branch ; branch = branch->cdr) {
+        assert(branch->p->prev == position);
+        ++count;
+    }
+    assert(count == position->nextcount);
+}
+
+/* Verify that positions with many branches are indexed, and that the
+ * next lists are maintained as they would be without the index.
+ */
+static void test_branchindex(void)
+{
+    redo_position *kids[300];
+    redo_memorystats stats;
+    redo_position *pos, *deep, *equiv;
+    size_t otherbytes;
+    int i;
+
+    setup();
+    memset(sbuf, 0, sizeof sbuf);
+    redo_getmemorystats(session, &stats);
+    otherbytes = stats.otherbytes;
+    assert(redo_setbranchindex(session, 16));
+    assert(redo_setbranchindex(session, 0));
+    assert(redo_setbranchindex(session, 16));
+    assert(!redo_setbranchindex(session, -1));
+    assert(!redo_setbranchindex(session, 0x10000));
+    rootpos = redo_getfirstposition(session);
+
+    /* Give the root many branches, with moves that are not in any
+     * order, and verify that each can be found.
+     */
+
+    for (i = 0 ; i < 300 ; ++i) {
+        sbuf[0] = 1;
+        sbuf[1] = i % 256;
+        sbuf[2] = i / 256;
+        kids[i] = redo_addposition(session, rootpos, i * 7919 % 1000, sbuf,
+                                   0, redo_check);
+        assert(kids[i]);
+        assert(rootpos->next->p == kids[i]);
+    }
+    assert(!redo_setbranchindex(session, 0));
+    assert(rootpos->nextcount == 300);
+    checknextlist(rootpos);
+    redo_getmemorystats(session, &stats);
+    assert(stats.otherbytes > otherbytes);
+    for (i = 0 ; i < 300 ; ++i) {
+        assert(redo_addposition(session, rootpos, i * 7919 % 1000, sbuf,
+                                0, redo_check) == kids[i]);
+        pos = redo_getnextposition(rootpos, i * 7919 % 1000);
+        assert(pos == kids[i]);
+        assert(rootpos->next->p == kids[i]);
+    }
+    assert(redo_getnextposition(rootpos, 1) == NULL);
+    assert(rootpos->nextcount == 300);
+    checknextlist(rootpos);
+
+    /* Verify that the list order is most recently used first. */
+
+    assert(redo_getnextposition(rootpos, 150 * 7919 % 1000) == kids[150]);
+    assert(redo_getnextposition(rootpos, 299 * 7919 % 1000) == kids[299]);
+    assert(rootpos->next->p == kids[299]);
+    assert(rootpos->next->cdr->p == kids[150]);
+    assert(rootpos->next->cdr->cdr->p == kids[298]);
+
+    /* Delete branches from the head, the tail, and the middle of the
+     * list, until the position drops below the threshold.
+     */
+
+    assert(redo_dropposition(session, kids[299]) == rootpos);
+    assert(redo_dropposition(session, kids[0]) == rootpos);
+    for (i = 1 ; i < 290 ; ++i)
+        if (i != 150)
+            assert(redo_dropposition(session, kids[i]) == rootpos);
+    checknextlist(rootpos);
+    assert(rootpos->nextcount == 10);
+    assert(redo_getnextposition(rootpos, 150 * 7919 % 1000) == kids[150]);
+    assert(redo_getnextposition(rootpos, 0) == NULL);
+    redo_getmemorystats(session, &stats);
+    assert(stats.otherbytes == otherbytes);
+
+    /* Verify that an index survives compaction, and moves with its
+     * position's branches when they are grafted onto another position.
+     */
+
+    sbuf[0] = 2;
+    sbuf[1] = 0;
+    sbuf[2] = 0;
+    deep = redo_addposition(session, kids[150], 0, sbuf, 0, redo_check);
+    assert(deep);
+    for (i = 0 ; i < 40 ; ++i) {
+        sbuf[0] = 3;
+        sbuf[1] = i;
+        assert(redo_addposition(session, deep, 1000 + i, sbuf,
+                                0, redo_check));
+    }
+    assert(redo_compactsession(session, &deep, 1));
+    rootpos = redo_getfirstposition(session);
+    checknextlist(deep);
+    for (i = 0 ; i < 40 ; ++i)
+        assert(redo_getnextposition(deep, 1000 + i)->prev == deep);
+    sbuf[0] = 2;
+    sbuf[1] = 0;
+    equiv = redo_addposition(session, rootpos, 2000, sbuf, 0, redo_check);
+    assert(equiv);
+    assert(deep->next == NULL && deep->nextcount == 0);
+    assert(equiv->nextcount == 40);
+    checknextlist(equiv);
+    for (i = 0 ; i < 40 ; ++i)
+        assert(redo_getnextposition(equiv, 1000 + i)->prev == equiv);
+    assert(redo_getnextposition(equiv, 999) == NULL);
+
+    teardown();
+}
+
+/* Verify that redo_suppresscycle() honors the search limit.
+ */
+static void test_cyclesearch(void)
+{
+    redo_position *line[100];
+    redo_position *pos;
+    int i;
+
+    setup();
+    memset(sbuf, 0, sizeof sbuf);
+
+    pos = rootpos;
+    for (i = 0 ; i < 100 ; ++i) {
+        sbuf[0] = i + 1;
+        pos = redo_addposition(session, pos, i, sbuf, 0, redo_check);
+        assert(pos);
+        line[i] = pos;
+    }
+
+    /* Verify that a state not in the session is not found. */
+
+    sbuf[0] = 127;
+    assert(!redo_suppresscycle(session, &pos, sbuf, 0));
+    assert(pos == line[99]);
+
+    /* Verify that a limited search won't find a distant state. */
+
+    assert(redo_setcyclesearchlimit(session, 50) == 0);
+    sbuf[0] = 11;
+    assert(!redo_suppresscycle(session, &pos, sbuf, 0));
+    assert(pos == line[99]);
+    sbuf[0] = 51;
+    assert(redo_suppresscycle(session, &pos, sbuf, 0));
+    assert(pos == line[50]);
+
+    /* Verify that an unlimited search will. */
+
+    pos = line[99];
+    assert(redo_setcyclesearchlimit(session, 0) == 50);
+    sbuf[0] = 11;
+    assert(redo_suppresscycle(session, &pos, sbuf, 0));
+    assert(pos == line[10]);
+    sbuf[0] = 0;
+    assert(redo_suppresscycle(session, &pos, sbuf, 0));
+    assert(pos == rootpos);
+    assert(redo_getsessionsize(session) == 101);
+
+    teardown();
+}
+
 int main(void)
 {
     test_init();
+    test_hashing();
     test_statecompares();
     test_overall(redo_nograft);
     test_overall(redo_graft);
     test_overall(redo_copypath);
     test_overall(redo_graftandcopy);
     test_endpoints();
+    test_setbetterfields();
+    test_equivclasses();
+    test_manytranspositions();
+    test_chunksizes();
+    test_compactsession();
+    test_branchindex();
+    test_cyclesearch();
+    test_largesession();
+    test_hashedstates();
+    test_statecallbacks();
+    test_canonicalstates();
+    test_canonicalgrafting();
+    test_deltastorage();
+    test_keyframestorage();
+    test_internedstorage();
+    test_separatestorage();
+    test_allocator();
+    test_positionindices();
+    test_hugestates();
+    test_memorystats();
+    test_memorylimit();
+    test_memorylimitgraft();
+    test_deeplines();
     return 0;
 }
@@ -10,8 +10,29 @@
 #include <stdlib.h>     /* malloc(), free(), size_t, and NULL */
 #include <string.h>     /* memcpy(), memset(), and memcmp() */
 #include <stdint.h>     /* uint32_t */
+#include <limits.h>     /* INT_MAX */
 #include "redo.h"
 
+/* On x86 processors, SIMD versions of the state hash function are
+ * selected at runtime when the processor supports them. (This
+ * requires compiler extensions that are provided by gcc and clang.
+ * Define REDO_NO_SIMD to use only the portable code.)
+ */
+#if !defined(REDO_NO_SIMD) && defined(__GNUC__) && \
+        (defined(__x86_64__) || defined(__i386__))
+#define REDO_X86_SIMD
+#include <immintrin.h>  /* SSE2 and AVX2 intrinsics */
+#endif
+
+/* Keep a function out of its callers, so that code that is rarely
+ * needed does not weigh on a function that is called constantly.
+ */
+#ifdef __GNUC__
+#define REDO_NOINLINE __attribute__((noinline))
+#else
+#define REDO_NOINLINE
+#endif
+
 /* There are three ways for a solution to be an improvement over what
  * a position currently has: either the position lacks a solution, the
  * position's solution has a lower endpoint value, or the position's
@@ -29,22 +50,89 @@ struct redo_session {
     redo_position *root;        /* the session tree's root position */
     redo_position *parray;      /* the allocated redo_position array */
     redo_position *pfree;       /* pointer to a redo_position not in use */
-    redo_branch *barray;        /* the allocated redo_branch array */
-    redo_branch *bfree;         /* pointer to a redo_branch not in use */
-    unsigned char *hashtable;   /* the session's hash table, if present */
+    redo_position **pages;      /* the first element of every index page */
+    unsigned int pagecount;     /* the number of index pages in use */
+    unsigned int pagealloc;     /* the number of index pages allocated */
+    unsigned int *hashtable;    /* the session's hash table, if present */
+    unsigned int hashtablesize; /* the number of buckets in the hash table */
+    unsigned int hashlimit;     /* position count that enlarges the table */
     unsigned int positioncount; /* how many positions are in the tree */
-    unsigned short statesize;   /* the size of the stored game state */
-    unsigned short cmpsize;     /* how much of the state to compare */
-    unsigned short elementsize; /* total byte size for each position */
+    unsigned int pchunksize;    /* element count of the next position chunk */
+    unsigned int pchunkcount;   /* how many position chunks are allocated */
+    unsigned long pslotcount;   /* how many positions the chunks can hold */
+    size_t statebytes;          /* memory used by separate state blocks */
+    size_t indexbytes;          /* memory used by branch indexes */
+    size_t memorylimit;         /* memory use that triggers eviction */
+    redo_position *clockhand;   /* where the search for evictions resumes */
+    redo_position *stalledkeep; /* spared by a search that came up short */
+    unsigned long collisions;   /* hash values matched but states didn't */
+    int cyclelimit;             /* how far back to look for cycles */
+    unsigned short hashload;    /* hash table load target, in percent */
+    unsigned short indexthreshold; /* branch count that creates an index */
+    unsigned int statesize;     /* the size of the stored game state */
+    unsigned int cmpsize;       /* how much of the state to compare */
+    unsigned int elementsize;   /* total byte size for each position */
     unsigned char changeflag;   /* used to track changes to the session */
     unsigned char grafting;     /* should grafts leave the solution path? */
+    redo_hashcallback hashfunc; /* the caller's state hash function */
+    redo_cmpcallback cmpfunc;   /* the caller's state comparison function */
+    void *funcdata;             /* the caller's data for the callbacks */
+    redo_canoncallback canonfunc; /* the caller's canonicalizing function */
+    void *canondata;            /* the caller's data for canonfunc */
+    void *canonbuf;             /* space for two canonicalized states */
+    void *statebuf;             /* space for four reconstructed states */
+    redo_movecallback movefunc; /* the caller's function for making moves */
+    void *movedata;             /* the caller's data for movefunc */
+    unsigned short snapinterval; /* most deltas allowed between snapshots */
+    unsigned char storage;      /* how the state data is stored */
+    redo_alloccallback allocfunc; /* the caller's allocation function */
+    redo_freecallback freefunc; /* the caller's deallocation function */
+    void *alloccontext;         /* the caller's data for the above */
 };
 
-/* The size, in bits, of a hash table. This size is chosen to be large
- * enough to work well with a wide range of tree sizes, while still
- * not taking up much space.
+/* The number of buckets in a newly created hash table, and the
+ * largest number of buckets that a hash table will grow to. (Both
+ * values must be powers of two.)
+ */
+static unsigned int const initialhashtablesize = 1024;
+static unsigned int const maxhashtablesize = 0x40000000;
+
+/* The multiplier used to remix hash values into bucket indices.
+ */
+static uint32_t const bucketmultiplier = 0x9E3779B1;
+
+/* The number of bits of an element index that select the element
+ * within its page, the number of pages in a newly created page table,
+ * and the most pages that a session can have. The largest value that
+ * fits in the hashnext field is reserved to mark the end of a list.
+ */
+static unsigned int const pagebits = 6;
+static unsigned int const initialpagealloc = 16;
+static unsigned int const maxpagecount = 0x0007FFFF;
+static unsigned int const noindex = 0x01FFFFFF;
+
+/* The largest value allowed in the fields of a position that count
+ * moves and branches. The wide counts stop short of the type's limit,
+ * so that they can also be handled as ints.
+ */
+#ifdef REDO_WIDE_COUNTS
+static unsigned long const maxcount = 0x7FFFFFFF;
+#else
+static unsigned long const maxcount = 0xFFFF;
+#endif
+
+/* The default load target for the hash table, expressed as the
+ * average number of positions per bucket, in percent.
+ */
+static int const defaulthashload = 100;
+
+/* The number of elements in the first chunks allocated for a session,
+ * the largest number that can be requested, and the size in bytes
+ * past which chunks stop growing.
  */
-static int const hashtablebitsize = 8191;
+static unsigned int const initialchunksize = 64;
+static unsigned int const maxchunksize = 0x1000000;
+static size_t const maxchunkbytes = 0x800000;
 
 /* Increment a redo_position pointer. (Although the size of a position
  * is constant for a given session, it is not available at compile
@@ -52,385 +140,1788 @@ static int const hashtablebitsize = 8191;
  */
 #define incpos(s, p) ((redo_position*)((char*)(p) + (s)->elementsize))
 
+/* The default allocation functions, used when the caller doesn't
+ * provide any.
+ */
+static void *defaultalloc(size_t size, void *context)
+{
+    (void)context;
+    return malloc(size);
+}
+
+static void defaultfree(void *ptr, void *context)
+{
+    (void)context;
+    free(ptr);
+}
+
+/* Allocate memory on behalf of a session.
+ */
+static void *allocate(redo_session const *session, size_t size)
+{
+    return session->allocfunc(size, session->alloccontext);
+}
+
+/* Free memory that was allocated on behalf of a session. Like free(),
+ * a NULL pointer is ignored.
+ */
+static void deallocate(redo_session const *session, void *ptr)
+{
+    if (ptr)
+        session->freefunc(ptr, session->alloccontext);
+}
+
 /*
  * The position hash table.
  *
- * The hash table takes the form of a bit vector. Each bit indicates
- * whether a hash value, modulo the hash table size, is present in the
- * table or not. (More information than this is not really needed, as
- * session sizes tend to be on the order of thousands rather than
- * millions.) The downside to buckets being a single bit is that when
- * a position is removed from the table, it is not possible to tell
- * directly if another position hashes to that bucket, so the entire
- * tree must be walked in order to update the hash table entry.
- * However, the deletion of positions is not the typical use case for
- * a history tracking library, so it makes sense to push the cost onto
- * this situation.
+ * The hash table is an array of buckets, each bucket being the head
+ * of a linked list of every position whose hash value, modulo the
+ * hash table size, selects that bucket. The lists are threaded
+ * through the hashnext field of redo_position. Looking for a given
+ * state thus only requires examining the positions in one bucket,
+ * and an empty bucket is immediately known to have no matches. The
+ * number of buckets is doubled whenever the number of positions in
+ * the session exceeds the load target, so that the buckets stay
+ * short as the session grows. When a position is removed from the
+ * session, it is simply unlinked from its bucket's list. Since
+ * positions with identical states always share a bucket, the bucket
+ * also provides the positions whose better fields might need to be
+ * updated when a position is removed.
  *
- * As the session is still functional without a hash table (just a bit
- * slower), it is not treated as an error if it is absent.
+ * The buckets and the hashnext fields refer to positions by an index
+ * instead of a pointer, which keeps the position structs small.
+ * Every element of every chunk is given an index when its chunk is
+ * allocated, and the indices are handed out in pages of 64 elements,
+ * so that an index can be turned back into a pointer by looking up
+ * its page in a table. There is no need to store an element's own
+ * index anywhere: as long as a position is in the hash table, its
+ * index is held by the bucket or by the position preceding it, and a
+ * position that is not in the hash table keeps its own index in its
+ * hashnext field instead. An index fits in 25 bits, so hashnext
+ * shares a word with the position's flags.
+ *
+ * As the session is still functional without a hash table (just a
+ * lot slower), it is not treated as an error if it is absent.
  */
 
-/* Compute the hash value for a given state. Every stored block of
- * state data is assigned a hash value, whether or not a hash table is
- * being used. (This is the Meiyan hash function, created by Sanmayce,
- * slightly simplified.)
+/* The constants used by the hash function.
+ */
+static uint32_t const hashmultiplier = 0x000AD3E7;
+static uint32_t const hashseed = 0x811C9DC5;
+
+/* Large states are hashed in blocks, with the words of each block
+ * being divided among a set of independent lanes. Smaller states are
+ * hashed serially, as for them the cost of combining the lanes would
+ * outweigh the benefit.
+ */
+#define HASHLANES 16
+#define HASHBLOCKSIZE (HASHLANES * 2 * sizeof(uint32_t))
+#define HASHLANEMINIMUM (4 * HASHBLOCKSIZE)
+
+/* Read a 32-bit word from a location that is not necessarily aligned.
+ */
+static uint32_t loadword(unsigned char const *p)
+{
+    uint32_t w;
+
+    memcpy(&w, p, sizeof w);
+    return w;
+}
+
+/* Hash count blocks of state data, updating the array of lane hash
+ * values. Each lane is a separate Meiyan hash that receives two words
+ * out of every block. Because the lanes are independent of each
+ * other, the work is not serialized through a single hash value, and
+ * it is easily done in parallel.
  */
-unsigned short gethashvalue(unsigned int const *data, size_t len)
+static void hashblocks(uint32_t *lanes, unsigned char const *data,
+                       size_t count)
 {
-    uint32_t const m = 0x000AD3E7;
-    uint32_t const seed = 0x811C9DC5;
-    uint32_t h, k, i;
+    uint32_t k;
+    int i;
 
-    for (h = seed ; len >= 2 * sizeof *data ; len -= 2 * sizeof *data) {
-        k = *data++;
-        k = ((k << 5) | (k >> 27)) ^ *data++;
-        h = (h ^ k) * m;
+    for ( ; count ; --count, data += HASHBLOCKSIZE) {
+        for (i = 0 ; i < HASHLANES ; ++i) {
+            k = loadword(data + i * 4);
+            k = ((k << 5) | (k >> 27)) ^ loadword(data + (HASHLANES + i) * 4);
+            lanes[i] = (lanes[i] ^ k) * hashmultiplier;
+        }
     }
-    for (i = 0 ; i < len ; ++i)
-        h ^= ((unsigned char*)data)[i] << (i * 8);
-    h *= m;
-    return (h ^ (h >> 16)) & 0xFFFF;
 }
 
-/* Reset the contents of the hash table.
+#ifdef REDO_X86_SIMD
+
+/* Multiply the 32-bit elements of two vectors, keeping the low 32
+ * bits of each product. (SSE2 lacks an instruction for this.)
  */
-static void emptyhashtable(redo_session *session)
+__attribute__((target("sse2")))
+static __m128i mullo32(__m128i a, __m128i b)
 {
-    if (session->hashtable)
-        memset(session->hashtable, 0, (hashtablebitsize + 7) / 8);
+    __m128i even, odd;
+
+    even = _mm_mul_epu32(a, b);
+    odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
 }
 
-/* Set up an empty hash table.
+/* The SSE2 version of hashblocks(), with the lanes split across four
+ * vectors.
  */
-static int createhashtable(redo_session *session)
+__attribute__((target("sse2")))
+static void hashblocks_sse2(uint32_t *lanes, unsigned char const *data,
+                            size_t count)
 {
-    session->hashtable = malloc((hashtablebitsize + 7) / 8);
-    emptyhashtable(session);
-    return session->hashtable != NULL;
+    __m128i const m = _mm_set1_epi32(hashmultiplier);
+    __m128i h[4], a, b;
+    int i;
+
+    for (i = 0 ; i < 4 ; ++i)
+        h[i] = _mm_loadu_si128((__m128i const*)(lanes + 4 * i));
+    for ( ; count ; --count, data += HASHBLOCKSIZE) {
+        for (i = 0 ; i < 4 ; ++i) {
+            a = _mm_loadu_si128((__m128i const*)(data + 16 * i));
+            b = _mm_loadu_si128((__m128i const*)(data + 64 + 16 * i));
+            a = _mm_or_si128(_mm_slli_epi32(a, 5), _mm_srli_epi32(a, 27));
+            h[i] = mullo32(_mm_xor_si128(h[i], _mm_xor_si128(a, b)), m);
+        }
+    }
+    for (i = 0 ; i < 4 ; ++i)
+        _mm_storeu_si128((__m128i*)(lanes + 4 * i), h[i]);
 }
 
-/* Mark a hash value as being present in the session.
+/* The AVX2 version of hashblocks(), with the lanes split across two
+ * vectors.
  */
-static int sethashentry(redo_session *session, unsigned short value)
+__attribute__((target("avx2")))
+static void hashblocks_avx2(uint32_t *lanes, unsigned char const *data,
+                            size_t count)
 {
-    int n;
+    __m256i const m = _mm256_set1_epi32(hashmultiplier);
+    __m256i h0, h1, a, b;
+
+    h0 = _mm256_loadu_si256((__m256i const*)lanes);
+    h1 = _mm256_loadu_si256((__m256i const*)(lanes + 8));
+    for ( ; count ; --count, data += HASHBLOCKSIZE) {
+        a = _mm256_loadu_si256((__m256i const*)data);
+        b = _mm256_loadu_si256((__m256i const*)(data + 64));
+        a = _mm256_or_si256(_mm256_slli_epi32(a, 5), _mm256_srli_epi32(a, 27));
+        h0 = _mm256_mullo_epi32(_mm256_xor_si256(h0, _mm256_xor_si256(a, b)),
+                                m);
+        a = _mm256_loadu_si256((__m256i const*)(data + 32));
+        b = _mm256_loadu_si256((__m256i const*)(data + 96));
+        a = _mm256_or_si256(_mm256_slli_epi32(a, 5), _mm256_srli_epi32(a, 27));
+        h1 = _mm256_mullo_epi32(_mm256_xor_si256(h1, _mm256_xor_si256(a, b)),
+                                m);
+    }
+    _mm256_storeu_si256((__m256i*)lanes, h0);
+    _mm256_storeu_si256((__m256i*)(lanes + 8), h1);
+}
 
-    if (!session->hashtable)
-        return 0;
-    n = value % hashtablebitsize;
-    session->hashtable[n / 8] |= 1 << n % 8;
-    return 1;
+#endif
+
+/* The type of the versions of hashblocks().
+ */
+typedef void hashblocksfunc(uint32_t *lanes, unsigned char const *data,
+                            size_t count);
+
+/* The version of hashblocks() selected for this processor, or NULL
+ * if one has not been selected yet. (Since every thread selects the
+ * same function, there is no harm in more than one of them storing
+ * it.)
+ */
+static hashblocksfunc *blockhasher = NULL;
+
+/* Return the fastest version of hashblocks() that the processor
+ * supports. The processor is only examined the first time.
+ */
+static hashblocksfunc *getblockhasher(void)
+{
+    if (!blockhasher) {
+#ifdef REDO_X86_SIMD
+        if (__builtin_cpu_supports("avx2"))
+            blockhasher = hashblocks_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+            blockhasher = hashblocks_sse2;
+        else
+#endif
+            blockhasher = hashblocks;
+    }
+    return blockhasher;
 }
 
-/* Return true if a hash table is present and the given value is not
- * in it, otherwise return false. The lookup is framed in the negative
- * because a value being in the hash table doesn't mean the actual
- * state is present, and similarly nothing certain can be said if the
- * hash table itself does not exist.
+/* Continue the hash value h over len bytes of state data, and return
+ * the final hash value. (This is the Meiyan hash function, created by
+ * Sanmayce, slightly simplified.) The state data need not be aligned.
  */
-static int notintable(redo_session const *session, unsigned short value)
+static uint32_t hashserial(uint32_t h, unsigned char const *data, size_t len)
 {
-    int n;
+    uint32_t k;
+    size_t n;
 
-    if (!session->hashtable)
-        return 0;
-    n = value % hashtablebitsize;
-    return !(session->hashtable[n / 8] & (1 << n % 8));
+    for ( ; len >= 2 * sizeof k ; len -= 2 * sizeof k, data += 2 * sizeof k) {
+        k = loadword(data);
+        k = ((k << 5) | (k >> 27)) ^ loadword(data + sizeof k);
+        h = (h ^ k) * hashmultiplier;
+    }
+    for (n = 0 ; n < len ; ++n)
+        h ^= (uint32_t)data[n] << (n % sizeof k * 8);
+    h *= hashmultiplier;
+    return h ^ (h >> 16);
 }
 
-/*
- * State data handling.
+/* Compute the hash value for a large state. The whole blocks of state
+ * data are hashed in parallel lanes, and the lane values are then
+ * combined in the usual way to start the hash of the remaining data.
+ * This is kept out of gethashvalue() so that the hashing of small
+ * states does not pay for setting up the lanes, or for the larger
+ * stack frame.
  */
+static REDO_NOINLINE uint32_t hashlargestate(unsigned char const *data,
+                                             size_t len)
+{
+    uint32_t lanes[HASHLANES];
+    uint32_t h;
+    size_t n;
+    int i;
+
+    for (i = 0 ; i < HASHLANES ; ++i)
+        lanes[i] = hashseed;
+    n = len / HASHBLOCKSIZE;
+    getblockhasher()(lanes, data, n);
+    h = hashseed;
+    for (i = 0 ; i < HASHLANES ; ++i)
+        h = (h ^ lanes[i]) * hashmultiplier;
+    return hashserial(h, data + n * HASHBLOCKSIZE, len - n * HASHBLOCKSIZE);
+}
 
-/* The state data is stored immediately following its position struct.
+/* Compute the hash value for a given state. Every stored block of
+ * state data is assigned a hash value, whether or not a hash table is
+ * being used.
  */
-static void const *getstatedata(redo_position const *position)
+static uint32_t gethashvalue(void const *state, size_t len)
 {
-    return position + 1;
+    if (len >= HASHLANEMINIMUM)
+        return hashlargestate(state, len);
+    return hashserial(hashseed, state, len);
 }
 
-/* Same, but accepting and returning a non-const pointer.
+/* Return the position with the given index, as found in the given
+ * table of pages. NULL is returned if the index marks the end of a
+ * list.
  */
-static void *getwriteablestatedata(redo_position *position)
+static redo_position *getpageelement(redo_session const *session,
+                                     redo_position * const *pages,
+                                     unsigned int index)
 {
-    return position + 1;
+    if (index == noindex)
+        return NULL;
+    return (redo_position*)((char*)pages[index >> pagebits] +
+               (index & ((1 << pagebits) - 1)) * (size_t)session->elementsize);
 }
 
-/* Copy a state to a position.
+/* Return the position with the given index.
  */
-static void savestatedata(redo_session const *session, redo_position *position,
-                          void const *state, int endpoint)
+static redo_position *getindexedposition(redo_session const *session,
+                                         unsigned int index)
 {
-    position->endpoint = endpoint;
-    position->hashvalue = gethashvalue(state, session->cmpsize);
-    memcpy(getwriteablestatedata(position), state, session->statesize);
+    return getpageelement(session, session->pages, index);
 }
 
-/* Test if the given state is identical to the one stored for a
- * position.
+/* Return the position following the given one in its hash table
+ * bucket, or NULL if it is the last.
  */
-static int comparestatedata(redo_session const *session,
-                            redo_position const *position, void const *state)
+static redo_position *gethashnext(redo_session const *session,
+                                  redo_position const *position)
 {
-    return !memcmp(getstatedata(position), state, session->cmpsize);
+    return getindexedposition(session, position->hashnext);
 }
 
-/* Copy only the extra state to a position, leaving the state data
- * used in comparisions unmodified.
+/* Remove every position from the hash table.
  */
-static void saveextrastatedata(redo_session const *session,
-                               redo_position *position, void const *state)
+static void emptyhashtable(redo_session *session)
 {
-    memcpy((char*)getwriteablestatedata(position) + session->cmpsize,
-           (char const*)state + session->cmpsize,
-           session->statesize - session->cmpsize);
+    redo_position *pos;
+    unsigned int index, next, i;
+
+    if (!session->hashtable)
+        return;
+    for (i = 0 ; i < session->hashtablesize ; ++i) {
+        for (index = session->hashtable[i] ; index != noindex ; index = next) {
+            pos = getindexedposition(session, index);
+            next = pos->hashnext;
+            pos->hashnext = index;
+        }
+        session->hashtable[i] = noindex;
+    }
 }
 
-/*
- * Memory management.
- *
- * redo_position structs are allocated in chunks, rather than have
- * each struct be a separate allocation. Unused structs are kept in a
- * linked list by reusing the prev field. (The inuse field indicates
- * whether or not a struct is currently being used.) The pfree field
- * of redo_session holds the head of this linked list. In addition,
- * each chunk is itself a member in a linked list: the last element in
- * each chunk is never used as a redo_position; instead, its prev
- * field points to the next chunk in the list of chunks. The parray
- * field of redo_session holds the head of this linked list. Every
- * redo_position struct is immediately followed by its own state
- * buffer. Because the state buffer's size is determined by the
- * caller, iterating over the elements of a chunk requires special
- * code to increment the element pointer.
- *
- * redo_branch structs are also allocated in chunks. Unused structs
- * are kept in a linked list by reusing the cdr field; a NULL value in
- * the p field indicates that a struct is unused. The redo_position
- * chunks reserve the first element, instead of the last, to hold the
- * pointer to the next chunk. redo_session usees the bfree and barray
- * fields to point to the heads of these lists.
+/* Compute the number of positions that a hash table with the given
+ * number of buckets can hold before it exceeds the load target. A
+ * table that cannot grow any further never exceeds it.
  */
+static unsigned int gethashlimit(redo_session const *session,
+                                 unsigned int size)
+{
+    double limit;
 
-/* Allocate a new array of positions and add it to the linked list.
+    if (size >= maxhashtablesize)
+        return (unsigned int)-1;
+    limit = (double)size * session->hashload / 100.0;
+    return limit < (unsigned int)-1 ? (unsigned int)limit : (unsigned int)-1;
+}
+
+/* Return the bucket for a hash value in a table of the given size.
+ * The value is remixed first, so that hash functions whose low bits
+ * are poorly distributed (as is common with sequential state data)
+ * still spread their positions evenly across the buckets.
  */
-static int newposarray(redo_session *session)
+static unsigned int getbucketindex(uint32_t value, unsigned int size)
 {
-    static int const size = 1024;
-    redo_position *array, *pos, *last;
-    int i;
+    value *= bucketmultiplier;
+    return (value ^ (value >> 16)) & (size - 1);
+}
+
+/* Set up an empty hash table.
+ */
+static int createhashtable(redo_session *session)
+{
+    unsigned int i;
 
-    array = malloc(size * (sizeof *array + session->elementsize));
-    if (!array)
+    session->hashtablesize = initialhashtablesize;
+    session->hashlimit = gethashlimit(session, session->hashtablesize);
+    session->hashtable = allocate(session, session->hashtablesize *
+                                         sizeof *session->hashtable);
+    if (!session->hashtable)
         return 0;
-    pos = array;
-    for (i = 0 ; i < size - 1 ; ++i) {
-        pos->inuse = 0;
-        pos->inarray = 1;
-        last = pos;
-        pos->prev = incpos(session, pos);
-        pos = pos->prev;
-    }
-    last->prev = NULL;
-    pos->inuse = 0;
-    pos->inarray = 0;
-    pos->prev = session->parray;
-    session->parray = array;
-    session->pfree = array;
+    for (i = 0 ; i < session->hashtablesize ; ++i)
+        session->hashtable[i] = noindex;
     return 1;
 }
 
-/* Allocate a new array of redo_branch structs and add it to the
- * linked list.
+/* Replace the hash table with a larger one, sized to bring the load
+ * back under the target, and move all the positions over to their
+ * new buckets. If the memory for a larger table is unavailable, the
+ * current table is left as is.
  */
-static int newbrancharray(redo_session *session)
+static void growhashtable(redo_session *session)
 {
-    static int const size = 1024;
-    redo_branch *array;
-    int i;
+    unsigned int *table;
+    redo_position *pos;
+    unsigned int size, index, next, i, n;
+
+    size = session->hashtablesize;
+    while (session->positioncount > gethashlimit(session, size))
+        size *= 2;
+    if (size == session->hashtablesize)
+        return;
+    table = allocate(session, size * sizeof *table);
+    if (!table)
+        return;
+    for (i = 0 ; i < size ; ++i)
+        table[i] = noindex;
+    for (i = 0 ; i < session->hashtablesize ; ++i) {
+        for (index = session->hashtable[i] ; index != noindex ; index = next) {
+            pos = getindexedposition(session, index);
+            next = pos->hashnext;
+            n = getbucketindex(pos->hashvalue, size);
+            pos->hashnext = table[n];
+            table[n] = index;
+        }
+    }
+    deallocate(session, session->hashtable);
+    session->hashtable = table;
+    session->hashtablesize = size;
+    session->hashlimit = gethashlimit(session, size);
+}
+
+/* Add a position to the hash table, enlarging the table first if it
+ * has become too full.
+ */
+static int sethashentry(redo_session *session, redo_position *position)
+{
+    unsigned int index, n;
 
-    array = malloc(size * sizeof *array);
-    if (!array)
+    if (!session->hashtable)
         return 0;
-    for (i = 1 ; i < size ; ++i) {
-        array[i].p = NULL;
-        array[i].cdr = &array[i + 1];
-    }
-    array[size - 1].cdr = NULL;
-    array[0].p = NULL;
-    array[0].cdr = session->barray;
-    session->barray = array;
-    session->bfree = array + 1;
+    if (session->positioncount > session->hashlimit)
+        growhashtable(session);
+    n = getbucketindex(position->hashvalue, session->hashtablesize);
+    index = position->hashnext;
+    position->hashnext = session->hashtable[n];
+    session->hashtable[n] = index;
     return 1;
 }
 
-/* Grab an unused redo_position and initialize it with the given state.
+/* Remove a position from the hash table. The function does nothing
+ * if the position is not present in the table.
  */
-static redo_position *getpositionstruct(redo_session *session,
-                                        void const *state, int endpoint)
+static void removehashentry(redo_session *session, redo_position *position)
 {
-    redo_position *position;
+    redo_position *pos, *prev;
+    unsigned int *bucket;
+    unsigned int index;
 
-    position = session->pfree;
-    session->pfree = session->pfree->prev;
-    if (!session->pfree)
-        if (!newposarray(session))
-            return NULL;
-    savestatedata(session, position, state, endpoint);
-    position->inuse = 1;
-    ++session->positioncount;
-    return position;
+    if (!session->hashtable)
+        return;
+    bucket = &session->hashtable[getbucketindex(position->hashvalue,
+                                                session->hashtablesize)];
+    prev = NULL;
+    for (index = *bucket ; index != noindex ; index = pos->hashnext) {
+        pos = getindexedposition(session, index);
+        if (pos == position) {
+            if (prev)
+                prev->hashnext = position->hashnext;
+            else
+                *bucket = position->hashnext;
+            position->hashnext = index;
+            break;
+        }
+        prev = pos;
+    }
 }
 
-/* Mark a redo_position as unused.
+/* Return the first position in the hash table bucket for the given
+ * hash value. NULL is returned if the bucket is empty.
  */
-static void droppositionstruct(redo_session *session, redo_position *position)
+static redo_position *gethashbucket(redo_session const *session,
+                                    uint32_t value)
 {
-    position->inuse = 0;
-    position->prev = session->pfree;
-    session->pfree = position;
-    --session->positioncount;
+    return getindexedposition(session,
+               session->hashtable[getbucketindex(value,
+                                                 session->hashtablesize)]);
 }
 
-/* Grab an unused redo_branch.
+/*
+ * State data handling.
+ *
+ * By default, the state data is stored immediately following its
+ * position struct. A session can instead store the comparing bytes of
+ * each state in a separately allocated block, which holds either a
+ * snapshot of all of the comparing bytes, or a delta that records
+ * only the bytes that differ from the state of the previous position.
+ * In this case, the memory following the position struct holds a
+ * pointer to the block, followed by the state's extra bytes, which
+ * are always stored in full. Every chain of deltas ends at a
+ * snapshot, and a snapshot records the session that it belongs to,
+ * so that a state can be reconstructed given only its position.
+ *
+ * A session can also store a snapshot for every position, but share
+ * a single snapshot among all of the positions that have identical
+ * comparing bytes. These snapshots are found by way of the hash
+ * table, and keep a count of the positions that refer to them. (This
+ * also allows the states of two positions to be compared by checking
+ * if they refer to the same snapshot.)
+ *
+ * A session can also keep every state in full, but apart from its
+ * position struct. In this case, each chunk of positions is followed
+ * by an area holding the states of the chunk's positions, and the
+ * block pointer of each element is set to its state when the chunk is
+ * created. The position structs are thus packed closely together, and
+ * scanning them does not require touching the state data. (The block
+ * pointer belongs to the element rather than to the position, and so
+ * is preserved when the element is reused.)
+ *
+ * Alternately, a session can store snapshots only every so often
+ * (and at positions with more than one following move), and store
+ * nothing for the other positions. Their states are reconstructed by
+ * starting with the previous position's state and passing it to the
+ * caller's function for applying moves. The block pointer is unused
+ * for such positions.
+ *
+ * Because deltas and moves only apply to the comparing bytes, changes
+ * to a position's extra bytes do not affect its descendants. The
+ * comparing bytes of a position never change, but a subtree can be
+ * grafted onto a different position, one that is only equivalent and
+ * not byte-for-byte identical (when the caller has supplied a
+ * comparison or canonicalizing function). When this happens, the
+ * children of the subtree are converted to snapshots first.
+ *
+ * Reconstructed states are placed in buffers belonging to the
+ * session. The first buffer receives the states returned by
+ * getstatedata(); the second holds states that must remain available
+ * while other states are examined; the last two are used when
+ * storing and converting states.
  */
-static redo_branch *getbranchstruct(redo_session *session, redo_position *p,
-                                    int move, redo_branch *cdr)
-{
-    redo_branch *branch;
 
-    branch = session->bfree;
-    session->bfree = branch->cdr;
-    if (!session->bfree)
-        if (!newbrancharray(session))
-            return NULL;
-    branch->p = p;
-    branch->move = move;
-    branch->cdr = cdr;
-    return branch;
-}
+/* The ways in which the comparing bytes of a state can be held. (The
+ * last value instead marks the extra element at the end of a chunk.)
+ */
+enum { heldinline = 0, heldsnapshot, helddelta, heldreplay, heldseparate,
+       endofchunk };
+
+/* The header of a snapshot block. The comparing bytes of the state
+ * immediately follow it.
+ */
+struct snapshot {
+    redo_session *session;      /* the session that owns the snapshot */
+    unsigned int refcount;      /* how many positions use the snapshot */
+};
+
+/* The default number of consecutive deltas that can be stored before
+ * another snapshot is required.
+ */
+static int const defaultsnapinterval = 32;
 
-/* Mark a redo_branch as unused.
+/* Return a pointer to one of the session's buffers for reconstructed
+ * states.
  */
-static void dropbranchstruct(redo_session *session, redo_branch *branch)
+static unsigned char *getstatebuf(redo_session const *session, int which)
 {
-    branch->p = NULL;
-    branch->cdr = session->bfree;
-    session->bfree = branch;
+    return (unsigned char*)session->statebuf +
+                                      which * (size_t)session->statesize;
 }
 
-/* Create a branch from the given position via the given move, if it
- * does not already exists.
+/* Return the branch that leads to a position, which is stored in the
+ * position's element.
  */
-static redo_branch *insertmoveto(redo_session *session,
-                                 redo_position *from, redo_position *to,
-                                 int move)
+static redo_branch *getincomingbranch(redo_position const *position)
 {
-    redo_branch *branch;
+    return (redo_branch*)position - 1;
+}
 
-    for (branch = from->next ; branch ; branch = branch->cdr)
-        if (branch->move == move)
-            return branch;
+/* Return the block that holds a position's comparing bytes, when they
+ * are not stored inline.
+ */
+static void *getstateblock(redo_position const *position)
+{
+    return *(void* const*)(position + 1);
+}
 
-    branch = getbranchstruct(session, to, move, from->next);
-    if (!branch)
-        return NULL;
-    from->next = branch;
-    ++from->nextcount;
-    return branch;
+/* Store the pointer to the block that holds a position's comparing
+ * bytes.
+ */
+static void setstateblock(redo_position *position, void *block)
+{
+    *(void**)(position + 1) = block;
 }
 
-/* Delete a branch representing a move between two positions. The
- * function does nothing if no such move exists.
+/* Return a pointer to a position's extra state data.
  */
-static redo_branch *dropmoveto(redo_session *session,
-                               redo_position *from, redo_position *to)
+static void *getextradata(redo_session const *session,
+                          redo_position const *position)
 {
-    redo_branch *branch, *next;
+    if (position->stored == heldinline)
+        return (char*)(position + 1) + session->cmpsize;
+    if (position->stored == heldseparate)
+        return (char*)getstateblock(position) + session->cmpsize;
+    return (char*)(position + 1) + sizeof(void*);
+}
 
-    next = from->next;
-    if (!next)
-        return NULL;
+/* Find the session that owns a position, by way of the snapshot at
+ * the head of its chain of deltas.
+ */
+static redo_session *findsession(redo_position const *position)
+{
+    while (position->stored != heldsnapshot)
+        position = position->prev;
+    return ((struct snapshot*)getstateblock(position))->session;
+}
 
-    if (next->p == to) {
-        from->next = next->cdr;
-    } else {
-        for (;;) {
-            branch = next;
-            next = next->cdr;
-            if (!next)
-                break;
-            if (next->p == to) {
-                branch->cdr = next->cdr;
-                break;
+/* Deltas are encoded as a sequence of runs. Each run begins with two
+ * unsigned shorts: the number of unchanged bytes to skip, and the
+ * number of changed bytes that follow. A run with both values zero
+ * marks the end of the delta. Short stretches of unchanged bytes are
+ * included in the surrounding run when that takes up less space than
+ * starting a new run. The return value is the size of the encoded
+ * delta; if out is NULL, the size is computed without storing it.
+ */
+static size_t encodedelta(unsigned char const *from, unsigned char const *to,
+                          size_t size, unsigned char *out)
+{
+    unsigned short run[2];
+    size_t done, start, end, n, len;
+
+    len = 0;
+    done = 0;
+    for (;;) {
+        for (start = done ; start < size && from[start] == to[start] ; ++start)
+            ;
+        if (start == size)
+            break;
+        end = start + 1;
+        for (n = end ; n < size && n - end < sizeof run ; ++n)
+            if (from[n] != to[n])
+                end = n + 1;
+        for ( ; start - done > 0xFFFF ; done += 0xFFFF) {
+            if (out) {
+                run[0] = 0xFFFF;
+                run[1] = 0;
+                memcpy(out + len, run, sizeof run);
+            }
+            len += sizeof run;
+        }
+        while (start < end) {
+            n = end - start > 0xFFFF ? 0xFFFF : end - start;
+            if (out) {
+                run[0] = start - done;
+                run[1] = n;
+                memcpy(out + len, run, sizeof run);
+                memcpy(out + len + sizeof run, to + start, n);
             }
+            len += sizeof run + n;
+            start += n;
+            done = start;
         }
     }
-    if (next) {
-        dropbranchstruct(session, next);
-        --from->nextcount;
+    if (out) {
+        run[0] = 0;
+        run[1] = 0;
+        memcpy(out + len, run, sizeof run);
     }
-
-    return next;
+    return len + sizeof run;
 }
 
-/* Compare the given state with all the states in the session. If any
- * positions with identical states are found, return the one with the
- * smallest move count. NULL is returned if no positions have a
- * matching state.
+/* Apply an encoded delta to a state.
  */
-static redo_position *checkforequiv(redo_session const *session,
-                                    void const *state)
+static void applydelta(unsigned char const *delta, unsigned char *state)
 {
-    redo_position *equiv, *pos;
-    unsigned short hashvalue;
+    unsigned short run[2];
 
-    hashvalue = gethashvalue(state, session->cmpsize);
-    if (notintable(session, hashvalue))
-        return NULL;
-    for (pos = session->parray  ; pos ; pos = pos->prev) {
-        for ( ; pos->inarray ; pos = incpos(session, pos)) {
-            if (!pos->inuse)
-                continue;
-            if (!pos->setbetter && pos->hashvalue == hashvalue &&
-                                   comparestatedata(session, pos, state)) {
-                equiv = pos;
-                while (equiv->better)
-                    equiv = equiv->better;
-                return equiv;
-            }
-        }
+    for (;;) {
+        memcpy(run, delta, sizeof run);
+        delta += sizeof run;
+        if (!run[0] && !run[1])
+            break;
+        state += run[0];
+        memcpy(state, delta, run[1]);
+        state += run[1];
+        delta += run[1];
     }
-    return NULL;
 }
 
-/* Empty the hash table and repopulate it from scratch, walking the
- * tree of positions.
+/* Return the size of an encoded delta.
  */
-static void recalchashtable(redo_session *session)
+static size_t getdeltasize(unsigned char const *delta)
 {
-    redo_position *pos;
+    unsigned short run[2];
+    size_t size;
 
-    if (!session->hashtable)
-        return;
-    emptyhashtable(session);
-    for (pos = session->parray  ; pos ; pos = pos->prev)
-        for ( ; pos->inarray ; pos = incpos(session, pos))
-            if (pos->inuse)
-                sethashentry(session, pos->hashvalue);
+    for (size = 0 ; ; size += sizeof run + run[1]) {
+        memcpy(run, delta + size, sizeof run);
+        if (!run[0] && !run[1])
+            return size + sizeof run;
+    }
 }
 
-/* Delete the nodes in the path leading from branchpoint to leaf in
- * the session. Nodes are deleted from leaf upwards. The return value
- * is true if all positions between leaf and branchpoint are deleted.
- * If a position is found that has more than one move leading from it,
- * no further deletions are done and the function returns false.
+/* Return the move that leads to a position.
  */
-static int prunebranch(redo_session *session, redo_position *leaf,
-                       redo_position *branchpoint)
+static int getmoveto(redo_position const *position)
 {
-    redo_position *pos;
-    int done;
+    return getincomingbranch(position)->move;
+}
+
+/* Return the number of positions in a row, ending with the given one,
+ * whose states are reconstructed by applying moves.
+ */
+static int getreplaydepth(redo_position const *position)
+{
+    int depth;
+
+    for (depth = 0 ; position->stored == heldreplay ; ++depth)
+        position = position->prev;
+    return depth;
+}
+
+/* Reconstruct the comparing bytes of a position's state in the given
+ * buffer, which must have room for the complete state. The return
+ * value is the number of deltas or moves that were applied.
+ */
+static int loadcmpstate(redo_session const *session,
+                        redo_position const *position, unsigned char *dest)
+{
+    int depth;
+
+    if (position->stored == heldinline) {
+        memcpy(dest, position + 1, session->cmpsize);
+        return 0;
+    }
+    if (position->stored == heldseparate) {
+        memcpy(dest, getstateblock(position), session->cmpsize);
+        return 0;
+    }
+    if (position->stored == heldsnapshot) {
+        memcpy(dest, (struct snapshot*)getstateblock(position) + 1,
+               session->cmpsize);
+        return 0;
+    }
+    depth = loadcmpstate(session, position->prev, dest);
+    if (position->stored == heldreplay) {
+        memcpy(dest + session->cmpsize,
+               getextradata(session, position->prev),
+               session->statesize - session->cmpsize);
+        session->movefunc(dest, session->statesize, getmoveto(position),
+                          session->movedata);
+    } else {
+        applydelta(getstateblock(position), dest);
+    }
+    return depth + 1;
+}
+
+/* Reconstruct a position's complete state in the given buffer.
+ */
+static void loadstatedata(redo_session const *session,
+                          redo_position const *position, unsigned char *dest)
+{
+    loadcmpstate(session, position, dest);
+    memcpy(dest + session->cmpsize, getextradata(session, position),
+           session->statesize - session->cmpsize);
+}
+
+/* Return a pointer to a position's state data. Unless the state is
+ * stored in full, it is reconstructed in the first buffer, and will
+ * only remain there until the next state is reconstructed.
+ */
+static void const *getstatedata(redo_session const *session,
+                                redo_position const *position)
+{
+    if (position->stored == heldinline)
+        return position + 1;
+    if (position->stored == heldseparate)
+        return getstateblock(position);
+    if (position->stored == heldsnapshot &&
+                        session->cmpsize == session->statesize)
+        return (struct snapshot*)getstateblock(position) + 1;
+    loadstatedata(session, position, getstatebuf(session, 0));
+    return getstatebuf(session, 0);
+}
+
+/* Return a pointer to the comparing bytes of a position's state. The
+ * pointer refers to the stored state data when possible, so that
+ * positions that share their state data produce the same pointer.
+ * Otherwise the state is reconstructed in the first buffer.
+ */
+static void const *getcmpdata(redo_session const *session,
+                              redo_position const *position)
+{
+    if (position->stored == heldinline)
+        return position + 1;
+    if (position->stored == heldseparate)
+        return getstateblock(position);
+    if (position->stored == heldsnapshot)
+        return (struct snapshot*)getstateblock(position) + 1;
+    loadstatedata(session, position, getstatebuf(session, 0));
+    return getstatebuf(session, 0);
+}
+
+/* Return a pointer to a position's state data, which will remain
+ * valid while other states are examined (but only until the next
+ * call to this function).
+ */
+static void const *holdstatedata(redo_session const *session,
+                                 redo_position const *position)
+{
+    if (position->stored == heldinline)
+        return position + 1;
+    if (position->stored == heldseparate)
+        return getstateblock(position);
+    loadstatedata(session, position, getstatebuf(session, 1));
+    return getstatebuf(session, 1);
+}
+
+/* Create a snapshot block for the comparing bytes of a state.
+ */
+static struct snapshot *newsnapshot(redo_session *session,
+                                    unsigned char const *state)
+{
+    struct snapshot *snapshot;
+
+    snapshot = allocate(session, sizeof *snapshot + session->cmpsize);
+    if (snapshot) {
+        session->statebytes += sizeof *snapshot + session->cmpsize;
+        snapshot->session = session;
+        snapshot->refcount = 1;
+        memcpy(snapshot + 1, state, session->cmpsize);
+    }
+    return snapshot;
+}
+
+/* Free the memory used to store a position's state data, if any.
+ */
+static void freestatedata(redo_session *session, redo_position *position)
+{
+    struct snapshot *snapshot;
+
+    if (position->stored == heldsnapshot) {
+        snapshot = getstateblock(position);
+        if (!--snapshot->refcount) {
+            session->statebytes -= sizeof *snapshot + session->cmpsize;
+            deallocate(session, snapshot);
+        }
+    } else if (position->stored == helddelta) {
+        session->statebytes -= getdeltasize(getstateblock(position));
+        deallocate(session, getstateblock(position));
+    }
+}
+
+/* Find a snapshot of the given comparing bytes that can be shared by
+ * a new position. NULL is returned if no position in the session is
+ * using one.
+ */
+static struct snapshot *findsharedsnapshot(redo_session const *session,
+                                           void const *state,
+                                           uint32_t hashvalue)
+{
+    redo_position *pos;
+    struct snapshot *snapshot;
+
+    if (!session->hashtable)
+        return NULL;
+    for (pos = gethashbucket(session, hashvalue) ; pos ;
+                                       pos = gethashnext(session, pos)) {
+        if (pos->hashvalue != hashvalue || pos->stored != heldsnapshot)
+            continue;
+        snapshot = getstateblock(pos);
+        if (!memcmp(snapshot + 1, state, session->cmpsize))
+            return snapshot;
+    }
+    return NULL;
+}
+
+/* Store a snapshot for a position whose state is currently being
+ * reconstructed from its previous position. False is returned if
+ * memory could not be allocated, in which case the position is left
+ * unchanged.
+ */
+static int makesnapshot(redo_session *session, redo_position *position)
+{
+    unsigned char *buf;
+    void *block;
+
+    buf = getstatebuf(session, 3);
+    loadcmpstate(session, position, buf);
+    block = newsnapshot(session, buf);
+    if (!block)
+        return 0;
+    freestatedata(session, position);
+    position->stored = heldsnapshot;
+    setstateblock(position, block);
+    return 1;
+}
+
+/* Store the comparing bytes of a state, for a position that follows
+ * prev. In a session that shares snapshots, an existing snapshot is
+ * used if there is one. In a session that stores deltas, a delta is
+ * used if prev's chain of deltas is not already too long, and if the
+ * delta is sufficiently smaller than the state. In a session that
+ * replays moves, nothing is stored if prev's chain is not too long,
+ * and prev itself gets a snapshot if it is about to acquire a second
+ * move. Otherwise, a new snapshot is created. False is returned if
+ * the memory for the state could not be allocated.
+ */
+static int savecmpstate(redo_session *session, redo_position *position,
+                        redo_position *prev, unsigned char const *state)
+{
+    unsigned char *parentstate, *delta;
+    void *block;
+    size_t size;
+
+    if (session->storage == redo_storefull) {
+        position->stored = heldinline;
+        memcpy(position + 1, state, session->cmpsize);
+        return 1;
+    }
+    if (session->storage == redo_storeseparate) {
+        position->stored = heldseparate;
+        memcpy(getstateblock(position), state, session->cmpsize);
+        return 1;
+    }
+    if (session->storage == redo_storeinterned) {
+        block = findsharedsnapshot(session, state, position->hashvalue);
+        if (block) {
+            ++((struct snapshot*)block)->refcount;
+            position->stored = heldsnapshot;
+            setstateblock(position, block);
+            return 1;
+        }
+    } else if (prev && session->storage == redo_storekeyframes) {
+        if (prev->next && prev->stored == heldreplay)
+            makesnapshot(session, prev);
+        if (getreplaydepth(prev) < session->snapinterval) {
+            position->stored = heldreplay;
+            setstateblock(position, NULL);
+            return 1;
+        }
+    } else if (prev) {
+        parentstate = getstatebuf(session, 2);
+        if (loadcmpstate(session, prev, parentstate) < session->snapinterval) {
+            size = encodedelta(parentstate, state, session->cmpsize, NULL);
+            if (size <= session->cmpsize / 2u) {
+                delta = allocate(session, size);
+                if (!delta)
+                    return 0;
+                session->statebytes += size;
+                encodedelta(parentstate, state, session->cmpsize, delta);
+                position->stored = helddelta;
+                setstateblock(position, delta);
+                return 1;
+            }
+        }
+    }
+    block = newsnapshot(session, state);
+    if (!block)
+        return 0;
+    position->stored = heldsnapshot;
+    setstateblock(position, block);
+    return 1;
+}
+
+/* Copy a state to a position, which will follow prev. False is
+ * returned if memory could not be allocated.
+ */
+static int savestatedata(redo_session *session, redo_position *position,
+                         redo_position *prev, void const *state,
+                         uint32_t hashvalue, int endpoint)
+{
+    position->endpoint = endpoint;
+    position->hashvalue = hashvalue;
+    if (!savecmpstate(session, position, prev, state))
+        return 0;
+    memcpy(getextradata(session, position),
+           (char const*)state + session->cmpsize,
+           session->statesize - session->cmpsize);
+    return 1;
+}
+
+/* Copy only the extra state to a position, leaving the state data
+ * used in comparisions unmodified.
+ */
+static void saveextrastatedata(redo_session const *session,
+                               redo_position *position, void const *state)
+{
+    memcpy(getextradata(session, position),
+           (char const*)state + session->cmpsize,
+           session->statesize - session->cmpsize);
+}
+
+/* Prepare the children of src to be moved to dest. If the comparing
+ * bytes of the two positions are not identical, then every child that
+ * is stored as a delta or reconstructed by applying a move is
+ * converted to a snapshot. False is returned
+ * if memory could not be allocated, in which case some children may
+ * have been converted, but the subtree cannot be moved.
+ */
+static int rebasechildren(redo_session *session, redo_position const *src,
+                          redo_position const *dest)
+{
+    redo_branch *branch;
+    unsigned char *buf;
+
+    if (session->storage == redo_storefull ||
+                session->storage == redo_storeseparate)
+        return 1;
+    buf = getstatebuf(session, 2);
+    loadcmpstate(session, src, buf);
+    loadcmpstate(session, dest, getstatebuf(session, 3));
+    if (!memcmp(buf, getstatebuf(session, 3), session->cmpsize))
+        return 1;
+    for (branch = src->next ; branch ; branch = branch->cdr)
+        if (branch->p && (branch->p->stored == helddelta ||
+                          branch->p->stored == heldreplay))
+            if (!makesnapshot(session, branch->p))
+                return 0;
+    return 1;
+}
+
+/* Return the canonical form of a state, if the caller has supplied a
+ * canonicalizing function, or else the state itself. which selects
+ * one of the two buffers available for canonical states.
+ */
+static void const *getcanonicalstate(redo_session const *session,
+                                     void const *state, int which)
+{
+    void *canon;
+
+    if (!session->canonfunc)
+        return state;
+    canon = (char*)session->canonbuf + which * (size_t)session->cmpsize;
+    session->canonfunc(canon, state, session->cmpsize, session->canondata);
+    return canon;
+}
+
+/* Compute the hash value for a state, using the caller's hash
+ * function if one has been supplied.
+ */
+static uint32_t hashstatedata(redo_session const *session, void const *state)
+{
+    state = getcanonicalstate(session, state, 0);
+    if (session->hashfunc)
+        return session->hashfunc(state, session->cmpsize, session->funcdata);
+    return gethashvalue(state, session->cmpsize);
+}
+
+/* Test if the given state is identical to the one stored for a
+ * position.
+ */
+static int comparestatedata(redo_session const *session,
+                            redo_position const *position, void const *state)
+{
+    void const *posstate;
+
+    posstate = getcmpdata(session, position);
+    if (posstate == state)
+        return 1;
+    posstate = getcanonicalstate(session, posstate, 0);
+    state = getcanonicalstate(session, state, 1);
+    if (session->cmpfunc)
+        return !session->cmpfunc(posstate, state,
+                                 session->cmpsize, session->funcdata);
+    return !memcmp(posstate, state, session->cmpsize);
+}
+
+/* Test if a position's state has exactly the same comparing bytes as
+ * the given state. This is always true of identical states unless
+ * the caller has supplied a canonicalizing function. Two states that
+ * only share a canonical form can have different moves available, and
+ * a move made from each can lead to different states, so moves and
+ * subtrees are never transferred between them.
+ */
+static int isexactmatch(redo_session const *session,
+                        redo_position const *position, void const *state)
+{
+    void const *posstate;
+
+    if (!session->canonfunc)
+        return 1;
+    posstate = getcmpdata(session, position);
+    return posstate == state || !memcmp(posstate, state, session->cmpsize);
+}
+
+/* Recompute the hash value of every position in the session, and
+ * rebuild the hash table from scratch.
+ */
+static void rehashsession(redo_session *session)
+{
+    redo_position *pos;
+
+    emptyhashtable(session);
+    for (pos = session->parray ; pos ; pos = pos->prev) {
+        for ( ; pos->stored != endofchunk ; pos = incpos(session, pos)) {
+            if (pos->inuse) {
+                pos->hashvalue = hashstatedata(session,
+                                               getstatedata(session, pos));
+                sethashentry(session, pos);
+            }
+        }
+    }
+}
+
+/*
+ * Memory management.
+ *
+ * redo_position structs are allocated in chunks, rather than have
+ * each struct be a separate allocation. Unused structs are kept in a
+ * linked list by reusing the prev field. (The inuse field indicates
+ * whether or not a struct is currently being used.) The pfree field
+ * of redo_session holds the head of this linked list. In addition,
+ * each chunk is itself a member in a linked list: the last element in
+ * each chunk is never used as a redo_position; instead, its prev
+ * field points to the next chunk in the list of chunks. The parray
+ * field of redo_session holds the head of this linked list. Every
+ * redo_position struct is immediately followed by its own state
+ * buffer (or by a pointer to it, when the states are stored apart
+ * from the positions, in an area at the end of the same chunk).
+ * Because the state buffer's size is determined by the caller,
+ * iterating over the elements of a chunk requires special code to
+ * increment the element pointer.
+ *
+ * Since every position except the root is reached by exactly one
+ * branch, the redo_branch struct for that branch is stored in the
+ * position's element, immediately before the redo_position struct.
+ * (The root's element has an unused one.) The branches in a next list
+ * are thus the children's own, and adding a position never requires
+ * a separate allocation for its branch. If the session indexes
+ * branches, each element also begins with a pointer to the position's
+ * branch index, ahead of the redo_branch. The positions in the chunk
+ * lists and the page table are addressed by their redo_position
+ * structs, so each chunk begins a little before its first position.
+ *
+ * A session's first chunks are small, and each subsequent chunk is
+ * twice the size of the previous one, until chunks reach a fixed
+ * size in bytes. Small sessions therefore stay small, while large
+ * sessions need comparatively few allocations.
+ */
+
+/* Return the number of bytes in an element that come before its
+ * redo_position struct, given whether or not branches are indexed.
+ */
+static size_t getelementoffset(int indexed)
+{
+    return sizeof(redo_branch) + (indexed ? sizeof(void*) : 0);
+}
+
+/* Return the size of the elements in the position chunks, for a
+ * session with the given state sizes, storage mode, and indexing.
+ * Zero is returned if the size is too large.
+ */
+static int getelementsize(int size, int cmpsize, int storage, int indexed)
+{
+    int n;
+
+    if (size > INT_MAX - (int)(sizeof(redo_branch) + sizeof(redo_position) +
+                               3 * sizeof(void*)))
+        return 0;
+    n = getelementoffset(indexed) + sizeof(redo_position);
+    if (storage == redo_storefull)
+        n += size;
+    else if (storage == redo_storeseparate)
+        n += sizeof(void*);
+    else
+        n += sizeof(void*) + size - cmpsize;
+    n += sizeof(void*) - 1;
+    n -= n % sizeof(void*);
+    return n;
+}
+
+/* Return the number of elements to use for the first position chunk
+ * of a session with the given element size. Sessions with very large
+ * states start with fewer elements, so that a short history does not
+ * reserve many megabytes of unused state data.
+ */
+static unsigned int getinitialchunksize(size_t elementsize)
+{
+    unsigned int size;
+
+    size = initialchunksize;
+    while (size > 2 && size * elementsize > maxchunkbytes)
+        size /= 2;
+    return size;
+}
+
+/* Return the number of elements to use for the chunk following one
+ * with the given number of elements.
+ */
+static unsigned int growchunksize(unsigned int size, size_t elementsize)
+{
+    if (size < maxchunksize && 2 * size * elementsize <= maxchunkbytes)
+        return 2 * size;
+    return size;
+}
+
+/* Make room in the table of pages for the given number of additional
+ * pages. False is returned if the memory could not be allocated, or
+ * if the session has run out of indices.
+ */
+static int reservepages(redo_session *session, unsigned int count)
+{
+    redo_position **pages;
+    unsigned int n;
+
+    if (count > maxpagecount - session->pagecount)
+        return 0;
+    if (count <= session->pagealloc - session->pagecount)
+        return 1;
+    n = session->pagealloc ? session->pagealloc : initialpagealloc;
+    while (n < session->pagecount + count)
+        n = n < maxpagecount / 2 ? 2 * n : maxpagecount;
+    pages = allocate(session, n * sizeof *pages);
+    if (!pages)
+        return 0;
+    if (session->pagecount)
+        memcpy(pages, session->pages, session->pagecount * sizeof *pages);
+    deallocate(session, session->pages);
+    session->pages = pages;
+    session->pagealloc = n;
+    return 1;
+}
+
+/* Allocate a new array of positions and add it to the linked list.
+ * Each element is given the next available index, which it holds in
+ * its hashnext field. If states are stored apart from the positions,
+ * the area for the states is allocated along with the array, and each
+ * element is given its portion of it.
+ */
+static int newposarray(redo_session *session)
+{
+    redo_position *array, *pos, *last;
+    unsigned char *chunk, *states;
+    size_t slotsize;
+    unsigned int size, pagecount, first, i;
+
+    size = session->pchunksize;
+    slotsize = session->elementsize;
+    if (session->storage == redo_storeseparate)
+        slotsize += session->statesize;
+    if (size > (size_t)-1 / slotsize)
+        return 0;
+    chunk = allocate(session, size * slotsize);
+    if (!chunk)
+        return 0;
+    pagecount = ((size - 1) >> pagebits) + 1;
+    if (!reservepages(session, pagecount)) {
+        deallocate(session, chunk);
+        return 0;
+    }
+    array = (redo_position*)(chunk +
+                             getelementoffset(session->indexthreshold));
+    first = session->pagecount << pagebits;
+    for (i = 0 ; i < pagecount ; ++i)
+        session->pages[session->pagecount++] =
+            (redo_position*)((char*)array +
+                             ((size_t)i << pagebits) * session->elementsize);
+    session->pchunksize = growchunksize(size, slotsize);
+    ++session->pchunkcount;
+    session->pslotcount += size - 1;
+    states = chunk + size * (size_t)session->elementsize;
+    pos = last = array;
+    for (i = 0 ; i < size - 1 ; ++i) {
+        pos->inuse = 0;
+        pos->indexed = 0;
+        pos->stored = heldinline;
+        pos->hashnext = first + i;
+        if (session->storage == redo_storeseparate)
+            setstateblock(pos, states + i * (size_t)session->statesize);
+        last = pos;
+        pos->prev = incpos(session, pos);
+        pos = pos->prev;
+    }
+    last->prev = NULL;
+    pos->inuse = 0;
+    pos->stored = endofchunk;
+    pos->prev = session->parray;
+    session->parray = array;
+    session->pfree = array;
+    return 1;
+}
+
+/* Free a chunk of positions.
+ */
+static void freeposarray(redo_session const *session, redo_position *array)
+{
+    if (array)
+        deallocate(session, (char*)array -
+                            getelementoffset(session->indexthreshold));
+}
+
+/* Grab an unused redo_position and initialize it with the given state,
+ * for a position that will follow prev.
+ */
+static redo_position *getpositionstruct(redo_session *session,
+                                        redo_position *prev,
+                                        void const *state, uint32_t hashvalue,
+                                        int endpoint)
+{
+    redo_position *position;
+
+    position = session->pfree;
+    if (position->prev) {
+        session->pfree = position->prev;
+    } else if (!newposarray(session)) {
+        return NULL;
+    }
+    if (!savestatedata(session, position, prev, state, hashvalue, endpoint)) {
+        position->prev = session->pfree;
+        session->pfree = position;
+        return NULL;
+    }
+    position->inuse = 1;
+    ++session->positioncount;
+    return position;
+}
+
+/* Mark a redo_position as unused.
+ */
+static void droppositionstruct(redo_session *session, redo_position *position)
+{
+    session->stalledkeep = NULL;
+    freestatedata(session, position);
+    position->inuse = 0;
+    position->prev = session->pfree;
+    session->pfree = position;
+    --session->positioncount;
+}
+
+/*
+ * Branch indexes.
+ *
+ * Finding a move in a next list normally means walking the list. If
+ * the caller enables branch indexes, then a position that acquires
+ * enough branches is given an index of them: an open-addressed hash
+ * table, keyed by move, that is kept in a separate block and found by
+ * way of a pointer at the start of the position's element. (The
+ * indexed field of redo_position records whether the pointer is
+ * valid, since the pointer is only present when indexes are enabled.)
+ * Alongside each branch, the index records the branch that precedes
+ * it in the next list, so that a branch can also be unlinked or moved
+ * to the front of the list without walking it. The index is kept for
+ * as long as the position has at least the threshold number of
+ * branches, and the table is replaced with a larger one whenever it
+ * becomes half full.
+ */
+
+/* An entry in a branch index: a branch, and its predecessor in the
+ * next list (or NULL if it is at the head of the list).
+ */
+struct indexentry {
+    redo_branch *branch;
+    redo_branch *pred;
+};
+
+/* The header of a branch index. The table of entries immediately
+ * follows it.
+ */
+struct branchindex {
+    struct indexentry *entries; /* the hash table */
+    unsigned int size;          /* the number of entries in the table */
+};
+
+/* The smallest number of entries in a branch index.
+ */
+static unsigned int const minindexsize = 16;
+
+/* Return a pointer to the field that holds a position's branch index.
+ */
+static struct branchindex **getindexfield(redo_position *position)
+{
+    return (struct branchindex**)getincomingbranch(position) - 1;
+}
+
+/* Return the number of bytes allocated for a branch index.
+ */
+static size_t getindexbytes(unsigned int size)
+{
+    return sizeof(struct branchindex) + size * sizeof(struct indexentry);
+}
+
+/* Return the entry in a position's branch index for the given move,
+ * or NULL if the position has no such branch.
+ */
+static struct indexentry *findindexentry(redo_position *position, int move)
+{
+    struct branchindex *index;
+    unsigned int i;
+
+    index = *getindexfield(position);
+    i = getbucketindex((uint32_t)move, index->size);
+    for ( ; index->entries[i].branch ; i = (i + 1) & (index->size - 1))
+        if (index->entries[i].branch->move == move)
+            return index->entries + i;
+    return NULL;
+}
+
+/* Add a branch to a branch index, which must have room for it.
+ */
+static void addindexentry(struct branchindex *index, redo_branch *branch,
+                          redo_branch *pred)
+{
+    unsigned int i;
+
+    i = getbucketindex((uint32_t)branch->move, index->size);
+    while (index->entries[i].branch)
+        i = (i + 1) & (index->size - 1);
+    index->entries[i].branch = branch;
+    index->entries[i].pred = pred;
+}
+
+/* Remove an entry from a branch index. The entries that follow it in
+ * the same run are shifted back, so that none of them are separated
+ * from their buckets by an empty entry.
+ */
+static void removeindexentry(struct branchindex *index,
+                             struct indexentry *entry)
+{
+    unsigned int mask, i, j, k;
+
+    mask = index->size - 1;
+    i = (unsigned int)(entry - index->entries);
+    for (j = (i + 1) & mask ; index->entries[j].branch ; j = (j + 1) & mask) {
+        k = getbucketindex((uint32_t)index->entries[j].branch->move,
+                           index->size);
+        if (((i - k) & mask) < ((j - k) & mask)) {
+            index->entries[i] = index->entries[j];
+            i = j;
+        }
+    }
+    index->entries[i].branch = NULL;
+}
+
+/* Refill a branch index from the position's next list.
+ */
+static void fillbranchindex(struct branchindex *index,
+                            redo_position const *position)
+{
+    redo_branch *branch, *pred;
+
+    memset(index->entries, 0, index->size * sizeof *index->entries);
+    pred = NULL;
+    for (branch = position->next ; branch ; branch = branch->cdr) {
+        addindexentry(index, branch, pred);
+        pred = branch;
+    }
+}
+
+/* Ensure that a position has a branch index with room for the given
+ * number of branches, creating or enlarging it as needed. The return
+ * value is false if the memory could not be allocated.
+ */
+static int reservebranchindex(redo_session *session, redo_position *position,
+                              unsigned long count)
+{
+    struct branchindex *index;
+    unsigned int size;
+
+    if (position->indexed && count <= (*getindexfield(position))->size / 2)
+        return 1;
+    for (size = minindexsize ; size / 2 < count ; size *= 2)
+        if (size >= maxhashtablesize)
+            return 0;
+    index = allocate(session, getindexbytes(size));
+    if (!index)
+        return 0;
+    index->entries = (struct indexentry*)(index + 1);
+    index->size = size;
+    fillbranchindex(index, position);
+    session->indexbytes += getindexbytes(size);
+    if (position->indexed) {
+        session->indexbytes -= getindexbytes((*getindexfield(position))->size);
+        deallocate(session, *getindexfield(position));
+    }
+    *getindexfield(position) = index;
+    position->indexed = 1;
+    return 1;
+}
+
+/* Free a position's branch index, if it has one.
+ */
+static void dropbranchindex(redo_session *session, redo_position *position)
+{
+    if (!position->indexed)
+        return;
+    session->indexbytes -= getindexbytes((*getindexfield(position))->size);
+    deallocate(session, *getindexfield(position));
+    position->indexed = 0;
+}
+
+/* Move a branch to the head of its position's next list.
+ */
+static void movetofront(redo_position *position, redo_branch *branch,
+                        redo_branch *pred)
+{
+    if (position->indexed) {
+        if (branch->cdr)
+            findindexentry(position, branch->cdr->move)->pred = pred;
+        findindexentry(position, position->next->move)->pred = branch;
+        findindexentry(position, branch->move)->pred = NULL;
+    }
+    pred->cdr = branch->cdr;
+    branch->cdr = position->next;
+    position->next = branch;
+}
+
+/* Create a branch from the given position via the given move, if it
+ * does not already exists.
+ */
+static redo_branch *insertmoveto(redo_session *session,
+                                 redo_position *from, redo_position *to,
+                                 int move)
+{
+    struct indexentry *entry;
+    redo_branch *branch;
+
+    if (from->indexed) {
+        entry = findindexentry(from, move);
+        if (entry)
+            return entry->branch;
+    } else {
+        for (branch = from->next ; branch ; branch = branch->cdr)
+            if (branch->move == move)
+                return branch;
+    }
+
+    if (from->nextcount >= maxcount)
+        return NULL;
+    if (session->indexthreshold &&
+                from->nextcount + 1 >= session->indexthreshold)
+        if (!reservebranchindex(session, from, from->nextcount + 1UL))
+            return NULL;
+    branch = getincomingbranch(to);
+    branch->p = to;
+    branch->move = move;
+    branch->cdr = from->next;
+    if (from->indexed) {
+        if (from->next)
+            findindexentry(from, from->next->move)->pred = branch;
+        addindexentry(*getindexfield(from), branch, NULL);
+    }
+    from->next = branch;
+    ++from->nextcount;
+    return branch;
+}
+
+/* Delete a branch representing a move between two positions. The
+ * function does nothing if no such move exists.
+ */
+static redo_branch *dropmoveto(redo_session *session,
+                               redo_position *from, redo_position *to)
+{
+    struct indexentry *entry;
+    redo_branch *branch, *next;
+
+    next = from->next;
+    if (!next)
+        return NULL;
+
+    if (from->indexed) {
+        entry = findindexentry(from, getincomingbranch(to)->move);
+        if (!entry || entry->branch->p != to)
+            return NULL;
+        next = entry->branch;
+        if (entry->pred)
+            entry->pred->cdr = next->cdr;
+        else
+            from->next = next->cdr;
+        if (next->cdr)
+            findindexentry(from, next->cdr->move)->pred = entry->pred;
+        removeindexentry(*getindexfield(from), entry);
+    } else if (next->p == to) {
+        from->next = next->cdr;
+    } else {
+        for (;;) {
+            branch = next;
+            next = next->cdr;
+            if (!next)
+                break;
+            if (next->p == to) {
+                branch->cdr = next->cdr;
+                break;
+            }
+        }
+    }
+    if (next) {
+        next->p = NULL;
+        --from->nextcount;
+        if (from->nextcount < session->indexthreshold)
+            dropbranchindex(session, from);
+    }
+
+    return next;
+}
+
+/*
+ * Equivalence classes.
+ *
+ * Positions with identical states form an equivalence class, which is
+ * maintained as a union-find structure, using the better fields as
+ * the parent links. Every class has one representative, the position
+ * with the smallest move count, which has a NULL better field. Every
+ * other member's better field leads, directly or via other members,
+ * to the representative. Whenever the representative is looked up,
+ * the path to it is compressed, so that chains of better fields do
+ * not build up over time. (Since every member of a class has the same
+ * state, a better field that points directly to the representative
+ * is always a valid one.) Changing the representative of a class
+ * only requires changing the better fields of the old and new
+ * representatives.
+ */
+
+/* Return the representative of a position's equivalence class. Every
+ * position passed through along the way has its better field changed
+ * to point directly to the representative.
+ */
+static redo_position *getrepresentative(redo_position *position)
+{
+    redo_position *rep, *next;
+
+    for (rep = position ; rep->better ; rep = rep->better) ;
+    for ( ; position != rep ; position = next) {
+        next = position->better;
+        position->better = rep;
+    }
+    return rep;
+}
+
+/* Make a position the representative of its class, in place of the
+ * current representative.
+ */
+static void setrepresentative(redo_position *position, redo_position *rep)
+{
+    rep->better = position;
+    position->better = NULL;
+}
+
+/* Test if a position's state is identical to the given state, which
+ * has the given hash value. The state data is only compared when the
+ * hash values are the same, and the times that the hash values match
+ * but the states don't are tallied.
+ */
+static int matchstate(redo_session *session, redo_position const *position,
+                      uint32_t hashvalue, void const *state)
+{
+    if (position->hashvalue != hashvalue)
+        return 0;
+    if (comparestatedata(session, position, state))
+        return 1;
+    ++session->collisions;
+    return 0;
+}
+
+/* Compare the given state, which has the given hash value, with the
+ * states in the session. If any positions with identical states are
+ * found, return the one with the smallest move count. NULL is
+ * returned if no positions have a matching state. (Every position
+ * with a matching state is a member of the same equivalence class,
+ * so the search can stop at the first one found.)
+ */
+static redo_position *checkforequiv(redo_session *session,
+                                    void const *state, uint32_t hashvalue)
+{
+    redo_position *pos;
+
+    if (session->hashtable) {
+        for (pos = gethashbucket(session, hashvalue) ; pos ;
+                                           pos = gethashnext(session, pos))
+            if (!pos->setbetter && matchstate(session, pos, hashvalue, state))
+                return getrepresentative(pos);
+        return NULL;
+    }
+    for (pos = session->parray  ; pos ; pos = pos->prev) {
+        for ( ; pos->stored != endofchunk ; pos = incpos(session, pos)) {
+            if (!pos->inuse)
+                continue;
+            if (!pos->setbetter && matchstate(session, pos, hashvalue, state))
+                return getrepresentative(pos);
+        }
+    }
+    return NULL;
+}
+
+/* Find the position with the smallest move count whose state is
+ * identical to that of a newly created position, which has not yet
+ * been added to the hash table. state is the new position's state.
+ * If the new position has a snapshot, the snapshot's data is used
+ * instead, so that positions sharing the snapshot are recognized by
+ * their pointers alone. And if the snapshot is not shared with any
+ * other positions, and states are compared byte for byte, then there
+ * is no need to search at all.
+ */
+static redo_position *findequivposition(redo_session *session,
+                                        redo_position const *position,
+                                        void const *state)
+{
+    struct snapshot *snapshot;
+
+    if (position->stored == heldsnapshot) {
+        snapshot = getstateblock(position);
+        if (session->storage == redo_storeinterned &&
+                    snapshot->refcount == 1 && session->hashtable &&
+                    !session->cmpfunc && !session->canonfunc)
+            return NULL;
+        state = snapshot + 1;
+    }
+    return checkforequiv(session, state, position->hashvalue);
+}
+
+/* Initialize the better fields for every position that has the same
+ * state as the given position, which must have setbetter flagged.
+ * All such positions share a hash table bucket, so only the one
+ * bucket is searched. The position with the smallest move count
+ * (favoring one that is not flagged) becomes the better position for
+ * all flagged positions, as well as for any unflagged ones that lack
+ * a better position. The return value is the number of better fields
+ * that were set.
+ */
+static int resolveequivclass(redo_session *session, redo_position *position)
+{
+    redo_position *best, *pos;
+    void const *state;
+    uint32_t hashvalue;
+    int count;
+
+    if (position->stored == heldinline || position->stored == heldsnapshot ||
+                position->stored == heldseparate)
+        state = getcmpdata(session, position);
+    else
+        state = holdstatedata(session, position);
+    hashvalue = position->hashvalue;
+    best = position;
+    for (pos = gethashbucket(session, hashvalue) ; pos ;
+                                       pos = gethashnext(session, pos)) {
+        if (pos == position || !matchstate(session, pos, hashvalue, state))
+            continue;
+        if (pos->movecount < best->movecount ||
+                (pos->movecount == best->movecount &&
+                                best->setbetter && !pos->setbetter))
+            best = pos;
+    }
+
+    count = 0;
+    for (pos = gethashbucket(session, hashvalue) ; pos ;
+                                       pos = gethashnext(session, pos)) {
+        if (pos != position && !matchstate(session, pos, hashvalue, state))
+            continue;
+        if (pos == best) {
+            if (pos->setbetter)
+                pos->better = NULL;
+        } else if (pos->setbetter || (!pos->better &&
+                                      pos->movecount > best->movecount)) {
+            pos->better = best;
+            ++count;
+        }
+        pos->setbetter = 0;
+    }
+    return count;
+}
+
+/* Remove all references to a position that is about to be deleted.
+ * The position is taken out of the hash table, and any better fields
+ * that point to it are changed to point to its own better position.
+ * If the position is the representative of its equivalence class,
+ * then the member with the smallest move count is chosen to replace
+ * it. (Only positions with an identical state can have their better
+ * field pointing to this position, so when the hash table is present
+ * it is only necessary to search one bucket. The paths within the
+ * bucket are compressed first, so that every member of the class
+ * points directly to the old representative when one is chosen.)
+ */
+static void forgetposition(redo_session *session, redo_position *position)
+{
+    redo_position *better, *pos;
+
+    removehashentry(session, position);
+    better = position->better;
+    if (session->hashtable) {
+        if (!better) {
+            for (pos = gethashbucket(session, position->hashvalue) ; pos ;
+                                           pos = gethashnext(session, pos))
+                if (pos->better)
+                    getrepresentative(pos);
+            for (pos = gethashbucket(session, position->hashvalue) ; pos ;
+                                           pos = gethashnext(session, pos))
+                if (pos->better == position &&
+                            (!better || pos->movecount < better->movecount))
+                    better = pos;
+        }
+        for (pos = gethashbucket(session, position->hashvalue) ; pos ;
+                                       pos = gethashnext(session, pos))
+            if (pos->better == position)
+                pos->better = pos == better ? NULL : better;
+        return;
+    }
+    for (pos = session->parray ; pos ; pos = pos->prev) {
+        for ( ; pos->stored != endofchunk ; pos = incpos(session, pos)) {
+            if (pos->inuse && pos->better == position) {
+                if (better) {
+                    pos->better = better;
+                } else {
+                    pos->better = NULL;
+                    better = pos;
+                }
+            }
+        }
+    }
+}
+
+/* Delete the nodes in the path leading from branchpoint to leaf in
+ * the session. Nodes are deleted from leaf upwards. The return value
+ * is true if all positions between leaf and branchpoint are deleted.
+ * If a position is found that has more than one move leading from it,
+ * no further deletions are done and the function returns false.
+ */
+static int prunebranch(redo_session *session, redo_position *leaf,
+                       redo_position *branchpoint)
+{
+    redo_position *pos;
+    int done;
 
     done = 1;
     pos = leaf;
@@ -442,88 +1933,394 @@ static int prunebranch(redo_session *session, redo_position *leaf,
         leaf = pos;
         pos = pos->prev;
         dropmoveto(session, pos, leaf);
+        forgetposition(session, leaf);
         droppositionstruct(session, leaf);
         session->changeflag = 1;
     }
-    if (pos != leaf)
-        recalchashtable(session);
     return done;
 }
 
-/* Change the movecount of the nodes of the subtree rooted at position
- * by delta. The solutionsize fields, if non-zero, are likewise
- * adjusted.
+/* Look for a position with the given state along the path leading to
+ * *pposition, going no further than the session's cycle search
+ * limit. Since every position is in the hash table, the table is
+ * consulted first to find how far up the path the nearest possible
+ * match could be. If no position in the session has the same hash
+ * value, the path doesn't need to be examined at all. Positions with
+ * no moves leading from them are passed over, since they cannot lie
+ * on the path, so the walk only goes as deep as the shallowest
+ * position that could be an ancestor. (A transposition that has been
+ * explored further can still draw the walk all the way up to it; the
+ * search limit is what bounds that case.) If a match is found,
+ * *pposition is changed to point to it, and the positions in between
+ * are pruned if they are within prunelimit.
+ */
+static int findcycle(redo_session *session, redo_position **pposition,
+                     void const *state, uint32_t hashvalue, int prunelimit)
+{
+    redo_position *p;
+    unsigned long mincount;
+    int n;
+
+    mincount = 0;
+    if (session->hashtable) {
+        mincount = (*pposition)->movecount + 1UL;
+        for (p = gethashbucket(session, hashvalue) ; p ;
+                                     p = gethashnext(session, p))
+            if (p->hashvalue == hashvalue && p->movecount < mincount &&
+                        (p->next || p == *pposition))
+                mincount = p->movecount;
+    }
+
+    for (p = *pposition, n = 0 ; p && p->movecount >= mincount ;
+                                 p = p->prev, ++n) {
+        if (session->cyclelimit && n >= session->cyclelimit)
+            break;
+        if (matchstate(session, p, hashvalue, state) &&
+                    isexactmatch(session, p, state)) {
+            if (n < prunelimit)
+                prunebranch(session, *pposition, p);
+            *pposition = p;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Return the first branch in a list that leads to a position.
+ */
+static redo_branch *firstchild(redo_branch *branch)
+{
+    while (branch && !branch->p)
+        branch = branch->cdr;
+    return branch;
+}
+
+/* Change the movecount of the nodes of the subtree rooted at top by
+ * delta. The solutionsize fields, if non-zero, are likewise adjusted.
+ * The subtree is traversed without recursion, using the prev fields
+ * to climb back up, since a subtree can be many thousands of moves
+ * deep.
+ */
+static void adjustmovecount(redo_position *top, int delta)
+{
+    redo_branch *branch;
+    redo_position *position, *rep;
+
+    position = top;
+    for (;;) {
+        position->movecount += delta;
+        if (position->solutionsize)
+            position->solutionsize += delta;
+        if (position->better) {
+            rep = getrepresentative(position);
+            if (rep->movecount > position->movecount)
+                setrepresentative(position, rep);
+        }
+        branch = firstchild(position->next);
+        while (!branch) {
+            if (position == top)
+                return;
+            branch = firstchild(getincomingbranch(position)->cdr);
+            position = position->prev;
+        }
+        position = branch->p;
+    }
+}
+
+/* Move the entire subtree rooted at src to dest, leaving src a leaf
+ * node upon return. No nodes are allocated or freed by this function.
+ */
+static void graftbranch(redo_position *dest, redo_position *src)
+{
+    redo_branch *branch;
+    redo_count size;
+    int n, e;
+
+    dest->next = src->next;
+    dest->nextcount = src->nextcount;
+    if (src->indexed) {
+        *getindexfield(dest) = *getindexfield(src);
+        dest->indexed = 1;
+        src->indexed = 0;
+    }
+    src->next = NULL;
+    src->nextcount = 0;
+    for (branch = dest->next ; branch ; branch = branch->cdr)
+        if (branch->p)
+            branch->p->prev = dest;
+    n = (int)dest->movecount - (int)src->movecount;
+    dest->movecount = src->movecount;
+    dest->solutionsize = src->solutionsize;
+    dest->solutionend = src->solutionend;
+    adjustmovecount(dest, n);
+    if (src->solutionend) {
+        e = dest->solutionend;
+        size = dest->solutionsize;
+        for (dest = dest->prev ; dest ; dest = dest->prev) {
+            if (!isimprovedsolution(dest, e, size))
+                break;
+            dest->solutionend = e;
+            dest->solutionsize = size;
+        }
+    }
+}
+
+/* Refresh the solutionsize field for each node along the path leading
+ * from the given node to the session's root node. Since a node's
+ * solution depends only on those of its children, the walk stops at
+ * the first node whose solution is unchanged.
+ */
+static void recalcsolutionsize(redo_position *position)
+{
+    redo_branch *branch;
+    redo_count size;
+    int end;
+
+    while (position) {
+        end = 0;
+        size = 0;
+        for (branch = position->next ; branch ; branch = branch->cdr) {
+            if (branch->p && !isimprovedsolution(branch->p, end, size)) {
+                size = branch->p->solutionsize;
+                end = branch->p->solutionend;
+            }
+        }
+        if (position->solutionsize == size && position->solutionend == end)
+            break;
+        position->solutionsize = size;
+        position->solutionend = end;
+        position = position->prev;
+    }
+}
+
+/* Apply the session's grafting behavior to a newly created position,
+ * which has replaced equiv as the representative of its class.
+ */
+static void applygrafting(redo_session *session, redo_position *position,
+                          redo_position *equiv)
+{
+    if (session->grafting == redo_copypath) {
+        redo_duplicatepath(session, position, equiv);
+    } else if (session->grafting != redo_nograft &&
+                        rebasechildren(session, equiv, position)) {
+        graftbranch(position, equiv);
+        recalcsolutionsize(equiv);
+        session->stalledkeep = NULL;
+        if (session->grafting == redo_graftandcopy)
+            redo_duplicatepath(session, equiv, position);
+    }
+}
+
+/* Add a new node to the session, leading from prev via move. The
+ * caller is responsible for verifying that prev does not already
+ * have a branch for this move. The state data is stored with the
+ * new position, along with its hash value. If checkequiv's value
+ * is redo_check, then the function will check for equivalent nodes in
+ * the session. If one is found, the better field will be intialized
+ * to point to it, or, if the new node is actually the other node's
+ * better, grafting behavior with be applied. (While the session is
+ * searched, the new node is flagged in the same way as a node whose
+ * check was deferred, so that it cannot find itself.)
+ */
+static redo_position *createposition(redo_session *session,
+                                     redo_position *prev, int move,
+                                     void const *state, uint32_t hashvalue,
+                                     int endpoint, int checkequiv)
+{
+    redo_position *position, *equiv, *p;
+    redo_branch *branch;
+    redo_count size;
+
+    if (prev && prev->movecount >= maxcount)
+        return NULL;
+    position = getpositionstruct(session, prev, state, hashvalue, endpoint);
+    if (!position)
+        return NULL;
+    position->setbetter = 1;
+    if (checkequiv == redo_check && endpoint == 0)
+        equiv = findequivposition(session, position, state);
+    else
+        equiv = NULL;
+    if (prev) {
+        branch = insertmoveto(session, prev, position, move);
+        if (!branch) {
+            droppositionstruct(session, position);
+            return NULL;
+        }
+    }
+    sethashentry(session, position);
+
+    position->better = NULL;
+    position->setbetter = checkequiv == redo_checklater;
+    position->touched = 1;
+    position->prev = prev;
+    position->next = NULL;
+    position->nextcount = 0;
+    position->indexed = 0;
+
+    position->movecount = prev ? prev->movecount + 1 : 0;
+    if (endpoint) {
+        size = position->movecount;
+        position->solutionend = endpoint;
+        position->solutionsize = size;
+        for (p = position->prev ; p ; p = p->prev) {
+            if (isimprovedsolution(p, endpoint, size)) {
+                p->solutionend = endpoint;
+                p->solutionsize = size;
+            }
+        }
+    } else {
+        position->solutionend = 0;
+        position->solutionsize = 0;
+    }
+
+    if (equiv) {
+        if (position->movecount >= equiv->movecount) {
+            position->better = equiv;
+        } else {
+            setrepresentative(position, equiv);
+            if (isexactmatch(session, equiv, state))
+                applygrafting(session, position, equiv);
+        }
+    }
+
+    session->changeflag = 1;
+    return position;
+}
+
+/*
+ * Memory limits.
+ *
+ * A session can be given a limit on the memory that it uses, counting
+ * only the slots in its chunks that are occupied. When an addition
+ * takes the session over its limit, positions are deleted until it is
+ * back under. Only leaves that are not on a solution path can be
+ * deleted, and the least recently visited ones are chosen using the
+ * clock algorithm: every position has a touched flag that is set when
+ * the caller visits it, and a hand sweeps through the position chunks,
+ * clearing the flag of each position it passes, and deleting the
+ * positions whose flag was already clear. When a leaf is deleted, its
+ * parent is deleted in turn if it has now become such a leaf, so that
+ * a neglected branch of the tree is removed in its entirety.
+ */
+
+/* Describe the session's memory. The sizes of the chunks are derived
+ * from the running counts of chunks and slots, so the session does not
+ * need to be traversed.
+ */
+static void describememory(redo_session const *session,
+                           redo_memorystats *stats)
+{
+    size_t slotsize;
+
+    slotsize = session->elementsize;
+    if (session->storage == redo_storeseparate)
+        slotsize += session->statesize;
+    stats->positionsize = (int)slotsize;
+    stats->positionchunks = session->pchunkcount;
+    stats->positionslots = session->pslotcount;
+    stats->freepositions = session->pslotcount - session->positioncount;
+    stats->positionbytes = (session->pslotcount + session->pchunkcount) *
+                           slotsize;
+    stats->positionusedbytes = session->positioncount * slotsize;
+    stats->statebytes = session->statebytes;
+    stats->hashtablebytes = 0;
+    if (session->hashtable)
+        stats->hashtablebytes = session->hashtablesize *
+                                sizeof *session->hashtable;
+    stats->otherbytes = sizeof *session +
+                        session->pagealloc * sizeof *session->pages;
+    if (session->statebuf)
+        stats->otherbytes += 4 * (size_t)session->statesize;
+    if (session->canonbuf)
+        stats->otherbytes += 2 * (size_t)session->cmpsize;
+    stats->otherbytes += session->indexbytes;
+    stats->totalbytes = stats->positionbytes + stats->statebytes +
+                        stats->hashtablebytes + stats->otherbytes;
+    stats->positionfragmentation = stats->positionslots ?
+        (int)(100.0 * stats->freepositions / stats->positionslots) : 0;
+}
+
+/* Return the amount of memory that the session is using, not counting
+ * the unused slots in its chunks.
  */
-static void adjustmovecount(redo_position *position, int delta)
+static size_t getmemoryinuse(redo_session const *session)
 {
-    redo_branch *branch;
+    redo_memorystats stats;
 
-    position->movecount += delta;
-    if (position->solutionsize)
-        position->solutionsize += delta;
-    if (position->better &&
-                position->better->movecount > position->movecount) {
-        position->better->better = position;
-        position->better = NULL;
-    }
-    for (branch = position->next ; branch ; branch = branch->cdr)
-        if (branch->p)
-            adjustmovecount(branch->p, delta);
+    describememory(session, &stats);
+    return stats.totalbytes - (stats.positionbytes - stats.positionusedbytes);
 }
 
-/* Move the entire subtree rooted at src to dest, leaving src a leaf
- * node upon return. No nodes are allocated or freed by this function.
+/* Return true if a position can be deleted to reclaim memory.
  */
-static void graftbranch(redo_position *dest, redo_position *src)
+static int isevictable(redo_position const *position,
+                       redo_position const *keep)
 {
-    redo_branch *branch;
-    int n, e;
-
-    dest->next = src->next;
-    dest->nextcount = src->nextcount;
-    src->next = NULL;
-    src->nextcount = 0;
-    for (branch = dest->next ; branch ; branch = branch->cdr)
-        if (branch->p)
-            branch->p->prev = dest;
-    n = dest->movecount - src->movecount;
-    dest->movecount = src->movecount;
-    dest->solutionsize = src->solutionsize;
-    dest->solutionend = src->solutionend;
-    adjustmovecount(dest, n);
-    if (src->solutionend) {
-        e = dest->solutionend;
-        n = dest->solutionsize;
-        for (dest = dest->prev ; dest ; dest = dest->prev) {
-            if (!isimprovedsolution(dest, e, n))
-                break;
-            dest->solutionend = e;
-            dest->solutionsize = n;
-        }
-    }
+    return position != keep && position->prev && !position->next &&
+           !position->solutionend && !position->touched;
 }
 
-/* Refresh the solutionsize field for each node along the path leading
- * from the given node to the session's root node.
+/* Delete positions until the session's memory use is within its
+ * limit, sparing keep. The search gives up after the hand has swept
+ * through every chunk twice, which is enough to clear every touched
+ * flag and then find every position that can be deleted. If the
+ * session is still over its limit, then nothing else can be deleted,
+ * and the position that was spared is remembered. Until a position is
+ * deleted by other means (which can leave its parent deletable), or a
+ * graft moves a branch away from a position (which can leave it as a
+ * leaf off of the solution path), the only position that can become
+ * deletable is the one that was spared, when the next addition does
+ * not follow from it. That position is then examined directly,
+ * instead of repeating the search.
  */
-static void recalcsolutionsize(redo_position *position)
+static void enforcememorylimit(redo_session *session, redo_position *keep)
 {
-    redo_branch *branch;
-    int size, end;
+    redo_position *pos, *p, *prev;
+    unsigned long count;
+
+    if (session->stalledkeep) {
+        p = session->stalledkeep;
+        if (keep != p && keep->prev != p) {
+            while (p != keep && p->prev && !p->next && !p->solutionend &&
+                        getmemoryinuse(session) > session->memorylimit) {
+                prev = redo_dropposition(session, p);
+                if (prev == p)
+                    break;
+                p = prev;
+            }
+        }
+        if (getmemoryinuse(session) > session->memorylimit)
+            session->stalledkeep = keep;
+        else
+            session->stalledkeep = NULL;
+        return;
+    }
 
-    while (position) {
-        end = 0;
-        size = 0;
-        for (branch = position->next ; branch ; branch = branch->cdr) {
-            if (branch->p && !isimprovedsolution(branch->p, end, size)) {
-                size = branch->p->solutionsize;
-                end = branch->p->solutionend;
+    count = 2 * (session->pslotcount + session->pchunkcount);
+    pos = session->clockhand;
+    while (count-- && getmemoryinuse(session) > session->memorylimit) {
+        if (!pos)
+            pos = session->parray;
+        while (pos->stored == endofchunk) {
+            pos = pos->prev;
+            if (!pos)
+                pos = session->parray;
+        }
+        if (pos->inuse && pos->touched) {
+            pos->touched = 0;
+        } else if (pos->inuse) {
+            for (p = pos ; isevictable(p, keep) ; p = prev) {
+                prev = redo_dropposition(session, p);
+                if (prev == p)
+                    break;
             }
         }
-        position->solutionsize = size;
-        position->solutionend = end;
-        position = position->prev;
+        pos = incpos(session, pos);
     }
+    session->clockhand = pos;
+    if (getmemoryinuse(session) > session->memorylimit)
+        session->stalledkeep = keep;
 }
 
 /*
@@ -534,30 +2331,74 @@ static void recalcsolutionsize(redo_position *position)
  */
 redo_session *redo_beginsession(void const *initialstate,
                                 int size, int cmpsize)
+{
+    return redo_beginsessionalloc(initialstate, size, cmpsize,
+                                  NULL, NULL, NULL);
+}
+
+/* Create a new session whose memory comes from the caller's
+ * allocation functions.
+ */
+redo_session *redo_beginsessionalloc(void const *initialstate,
+                                     int size, int cmpsize,
+                                     redo_alloccallback allocfunc,
+                                     redo_freecallback freefunc,
+                                     void *context)
 {
     redo_session *session;
     int n;
 
     if (size <= 0 || cmpsize < 0 || cmpsize > size)
         return NULL;
-    n = sizeof(redo_position) + size + (sizeof(void*) - 1);
-    n = n - n % sizeof(void*);
-    if (n > 0xFFFF)
+    n = getelementsize(size, size, redo_storefull, 0);
+    if (!n)
         return NULL;
-    session = malloc(sizeof *session);
+    if (!allocfunc || !freefunc) {
+        allocfunc = defaultalloc;
+        freefunc = defaultfree;
+        context = NULL;
+    }
+    session = allocfunc(sizeof *session, context);
     if (!session)
         return NULL;
+    session->allocfunc = allocfunc;
+    session->freefunc = freefunc;
+    session->alloccontext = context;
     session->statesize = size;
     session->cmpsize = cmpsize ? cmpsize : size;
     session->elementsize = n;
     session->grafting = redo_graft;
+    session->cyclelimit = 0;
+    session->hashfunc = NULL;
+    session->cmpfunc = NULL;
+    session->funcdata = NULL;
+    session->canonfunc = NULL;
+    session->canondata = NULL;
+    session->canonbuf = NULL;
+    session->statebuf = NULL;
+    session->movefunc = NULL;
+    session->movedata = NULL;
+    session->snapinterval = defaultsnapinterval;
+    session->storage = redo_storefull;
     session->parray = NULL;
     session->pfree = NULL;
-    session->barray = NULL;
-    session->bfree = NULL;
+    session->pages = NULL;
+    session->pagecount = 0;
+    session->pagealloc = 0;
     session->positioncount = 0;
+    session->pchunkcount = 0;
+    session->pslotcount = 0;
+    session->statebytes = 0;
+    session->indexbytes = 0;
+    session->memorylimit = 0;
+    session->clockhand = NULL;
+    session->stalledkeep = NULL;
+    session->pchunksize = getinitialchunksize(n);
+    session->collisions = 0;
+    session->hashload = defaulthashload;
+    session->indexthreshold = 0;
     createhashtable(session);
-    if (!newposarray(session) || !newbrancharray(session)) {
+    if (!newposarray(session)) {
         redo_endsession(session);
         return NULL;
     }
@@ -570,6 +2411,236 @@ redo_session *redo_beginsession(void const *initialstate,
     return session;
 }
 
+/* Change the hash table's load target, enlarging the table if it is
+ * now over the new target.
+ */
+int redo_sethashload(redo_session *session, int load)
+{
+    int oldvalue;
+
+    oldvalue = session->hashload;
+    if (load > 0 && load <= 0xFFFF) {
+        session->hashload = load;
+        if (session->hashtable) {
+            session->hashlimit = gethashlimit(session,
+                                              session->hashtablesize);
+            if (session->positioncount > session->hashlimit)
+                growhashtable(session);
+        }
+    }
+    return oldvalue;
+}
+
+/* Install the caller's state hashing and comparison functions. If
+ * the hash function is changed, every position is rehashed.
+ */
+void redo_setstatecallbacks(redo_session *session, redo_hashcallback hashfunc,
+                            redo_cmpcallback cmpfunc, void *data)
+{
+    int rehash;
+
+    rehash = hashfunc != session->hashfunc || data != session->funcdata;
+    session->hashfunc = hashfunc;
+    session->cmpfunc = cmpfunc;
+    session->funcdata = data;
+    if (rehash)
+        rehashsession(session);
+}
+
+/* Install the caller's canonicalizing function, allocating the
+ * buffers for the canonical states on first use. Every position is
+ * rehashed.
+ */
+int redo_setcanonicalizer(redo_session *session,
+                          redo_canoncallback canonfunc, void *data)
+{
+    if (canonfunc && !session->canonbuf) {
+        session->canonbuf = allocate(session, 2 * (size_t)session->cmpsize);
+        if (!session->canonbuf)
+            return 0;
+    }
+    session->canonfunc = canonfunc;
+    session->canondata = data;
+    rehashsession(session);
+    return 1;
+}
+
+/* Change the layout of a session's elements, for the given storage
+ * mode and branch index threshold. The session must contain only its
+ * root position, which is recreated in a new chunk, after which the
+ * old chunks are freed. The return value is false if the memory could
+ * not be allocated, in which case the session is unchanged.
+ */
+static int reformatsession(redo_session *session, int mode, int interval,
+                           int threshold)
+{
+    redo_position *oldroot, *oldparray, *oldpfree, *root, *pos, *p;
+    redo_position **oldpages;
+    unsigned int oldpagecount, oldpagealloc, oldchunkcount;
+    unsigned long oldslotcount;
+    unsigned int oldelementsize;
+    unsigned short oldsnapinterval, oldthreshold;
+    unsigned char oldstorage, changeflag;
+    int n;
+
+    n = getelementsize(session->statesize, session->cmpsize, mode,
+                       threshold);
+    if (!n)
+        return 0;
+    if (!session->statebuf && mode != redo_storefull &&
+                              mode != redo_storeseparate) {
+        session->statebuf = allocate(session, 4 * (size_t)session->statesize);
+        if (!session->statebuf)
+            return 0;
+    }
+
+    oldroot = session->root;
+    oldparray = session->parray;
+    oldpfree = session->pfree;
+    oldelementsize = session->elementsize;
+    oldsnapinterval = session->snapinterval;
+    oldstorage = session->storage;
+    oldthreshold = session->indexthreshold;
+    changeflag = session->changeflag;
+    removehashentry(session, oldroot);
+    oldpages = session->pages;
+    oldpagecount = session->pagecount;
+    oldpagealloc = session->pagealloc;
+    session->pages = NULL;
+    session->pagecount = 0;
+    session->pagealloc = 0;
+    oldchunkcount = session->pchunkcount;
+    oldslotcount = session->pslotcount;
+    session->pchunkcount = 0;
+    session->pslotcount = 0;
+    session->parray = NULL;
+    session->elementsize = n;
+    session->snapinterval = interval;
+    session->storage = mode;
+    session->indexthreshold = threshold;
+    session->positioncount = 0;
+    root = NULL;
+    if (newposarray(session))
+        root = createposition(session, NULL, 0,
+                              holdstatedata(session, oldroot),
+                              oldroot->hashvalue, 0, 0);
+    if (!root) {
+        freeposarray(session, session->parray);
+        deallocate(session, session->pages);
+        session->pages = oldpages;
+        session->pagecount = oldpagecount;
+        session->pagealloc = oldpagealloc;
+        session->pchunkcount = oldchunkcount;
+        session->pslotcount = oldslotcount;
+        session->parray = oldparray;
+        session->pfree = oldpfree;
+        session->elementsize = oldelementsize;
+        session->snapinterval = oldsnapinterval;
+        session->storage = oldstorage;
+        session->indexthreshold = oldthreshold;
+        session->positioncount = 1;
+        sethashentry(session, oldroot);
+        return 0;
+    }
+    session->root = root;
+    session->changeflag = changeflag;
+    session->clockhand = NULL;
+    session->stalledkeep = NULL;
+
+    freestatedata(session, oldroot);
+    deallocate(session, oldpages);
+    for (pos = oldparray ; pos ; pos = p) {
+        for (p = pos ; p->stored != endofchunk ;
+                       p = (redo_position*)((char*)p + oldelementsize)) ;
+        p = p->prev;
+        deallocate(session, (char*)pos - getelementoffset(oldthreshold));
+    }
+    return 1;
+}
+
+/* Change how the session stores state data. Since this changes the
+ * size of the position structs, the session is reformatted.
+ */
+int redo_setstoragemode(redo_session *session, int mode, int interval)
+{
+    if (session->positioncount > 1 || interval < 0 || interval > 0xFFFF)
+        return 0;
+    if (mode != redo_storefull && mode != redo_storedeltas &&
+                mode != redo_storekeyframes && mode != redo_storeinterned &&
+                mode != redo_storeseparate)
+        return 0;
+    if (mode == redo_storekeyframes && !session->movefunc)
+        return 0;
+    return reformatsession(session, mode,
+                           interval ? interval : defaultsnapinterval,
+                           session->indexthreshold);
+}
+
+/* Enable or disable branch indexes. Since indexes require space in
+ * every element, the session is reformatted when they are turned on
+ * or off.
+ */
+int redo_setbranchindex(redo_session *session, int threshold)
+{
+    if (session->positioncount > 1 || threshold < 0 || threshold > 0xFFFF)
+        return 0;
+    if (!threshold == !session->indexthreshold) {
+        session->indexthreshold = threshold;
+        return 1;
+    }
+    return reformatsession(session, session->storage, session->snapinterval,
+                           threshold);
+}
+
+/* Install the caller's function for applying moves to states.
+ */
+int redo_setmovecallback(redo_session *session, redo_movecallback movefunc,
+                         void *data)
+{
+    if (!movefunc && session->storage == redo_storekeyframes)
+        return 0;
+    session->movefunc = movefunc;
+    session->movedata = data;
+    return 1;
+}
+
+/* Change the size of the chunks that will be allocated next.
+ */
+int redo_setchunksize(redo_session *session, int size)
+{
+    int oldvalue;
+
+    oldvalue = session->pchunksize;
+    if (size >= 2 && (unsigned int)size <= maxchunksize) {
+        session->pchunksize = size;
+    }
+    return oldvalue;
+}
+
+/* Change the session's memory limit.
+ */
+size_t redo_setmemorylimit(redo_session *session, size_t limit)
+{
+    size_t oldvalue;
+
+    oldvalue = session->memorylimit;
+    session->memorylimit = limit;
+    session->stalledkeep = NULL;
+    return oldvalue;
+}
+
+/* Change the maximum distance searched for cycles.
+ */
+int redo_setcyclesearchlimit(redo_session *session, int limit)
+{
+    int oldvalue;
+
+    oldvalue = session->cyclelimit;
+    if (limit >= 0)
+        session->cyclelimit = limit;
+    return oldvalue;
+}
+
 /* Change the grafting behavior option.
  */
 int redo_setgraftbehavior(redo_session *session, int grafting)
@@ -599,7 +2670,11 @@ int redo_getsessionsize(redo_session const *session)
  */
 void const *redo_getsavedstate(redo_position const *position)
 {
-    return getstatedata(position);
+    if (position->stored == heldinline)
+        return position + 1;
+    if (position->stored == heldseparate)
+        return getstateblock(position);
+    return getstatedata(findsession(position), position);
 }
 
 /* Update the state data without error checking.
@@ -613,22 +2688,35 @@ void redo_updatesavedstate(redo_session const *session,
 /* Return the redo_branch for the branch originating at this position
  * and labelled with this move. NULL is returned if there is no such
  * branch in the session. If the branch is found, it is automatically
- * moved to the head of the next list.
+ * moved to the head of the next list, and both positions are marked as
+ * recently visited.
  */
 redo_position *redo_getnextposition(redo_position *position, int move)
 {
+    struct indexentry *entry;
     redo_branch *branch, *cdr;
 
     if (!position->next)
         return NULL;
-    if (position->next->move == move)
+    position->touched = 1;
+    if (position->next->move == move) {
+        position->next->p->touched = 1;
         return position->next->p;
+    }
+    if (position->indexed) {
+        entry = findindexentry(position, move);
+        if (!entry)
+            return NULL;
+        cdr = entry->branch;
+        movetofront(position, cdr, entry->pred);
+        cdr->p->touched = 1;
+        return cdr->p;
+    }
     for (branch = position->next ; branch->cdr ; branch = branch->cdr) {
         if (branch->cdr->move == move) {
             cdr = branch->cdr;
-            branch->cdr = branch->cdr->cdr;
-            cdr->cdr = position->next;
-            position->next = cdr;
+            movetofront(position, cdr, branch);
+            cdr->p->touched = 1;
             return cdr->p;
         }
     }
@@ -637,87 +2725,61 @@ redo_position *redo_getnextposition(redo_position *position, int move)
 
 /* Add a new node to the session, leading from prev via move. If such
  * a node already exists, it is returned; otherwise, the node is
- * created, fully initialized, and returned. In the latter case, the
- * state data is stored with the new position. If checkequiv's value
- * is redo_check, then the function will check for equivalent nodes in
- * the session. If one is found, the better field will be intialized
- * to point to it, or, if the new node is actually the other node's
- * better, grafting behavior with be applied.
+ * created, fully initialized, and returned.
  */
 redo_position *redo_addposition(redo_session *session,
                                 redo_position *prev, int move,
                                 void const *state, int endpoint,
                                 int checkequiv)
 {
-    redo_position *position, *equiv, *p;
-    redo_branch *branch;
-    unsigned short size;
+    redo_position *position;
 
     if (prev) {
         position = redo_getnextposition(prev, move);
         if (position)
             return position;
     }
+    position = createposition(session, prev, move, state,
+                              hashstatedata(session, state),
+                              endpoint, checkequiv);
+    if (position && session->memorylimit)
+        enforcememorylimit(session, position);
+    return position;
+}
 
-    if (checkequiv == redo_check && endpoint == 0)
-        equiv = checkforequiv(session, state);
-    else
-        equiv = NULL;
+/* Add a new node to the session, using the caller's hash value for
+ * the state instead of computing it.
+ */
+redo_position *redo_addpositionhashed(redo_session *session,
+                                      redo_position *prev, int move,
+                                      void const *state, unsigned int hashvalue,
+                                      int endpoint, int checkequiv)
+{
+    redo_position *position;
 
-    position = getpositionstruct(session, state, endpoint);
-    if (!position)
-        return NULL;
     if (prev) {
-        branch = insertmoveto(session, prev, position, move);
-        if (!branch) {
-            droppositionstruct(session, position);
-            return NULL;
-        }
-    }
-    sethashentry(session, position->hashvalue);
-
-    position->better = NULL;
-    position->setbetter = checkequiv == redo_checklater;
-    position->prev = prev;
-    position->next = NULL;
-    position->nextcount = 0;
-
-    position->movecount = prev ? prev->movecount + 1 : 0;
-    if (endpoint) {
-        size = position->movecount;
-        position->solutionend = endpoint;
-        position->solutionsize = size;
-        for (p = position->prev ; p ; p = p->prev) {
-            if (isimprovedsolution(p, endpoint, size)) {
-                p->solutionend = endpoint;
-                p->solutionsize = size;
-            }
-        }
-    } else {
-        position->solutionend = 0;
-        position->solutionsize = 0;
-    }
-
-    if (equiv) {
-        if (position->movecount >= equiv->movecount) {
-            position->better = equiv;
-        } else {
-            equiv->better = position;
-            if (session->grafting == redo_copypath) {
-                redo_duplicatepath(session, position, equiv);
-            } else if (session->grafting != redo_nograft) {
-                graftbranch(position, equiv);
-                recalcsolutionsize(equiv);
-                if (session->grafting == redo_graftandcopy)
-                    redo_duplicatepath(session, equiv, position);
-            }
-        }
+        position = redo_getnextposition(prev, move);
+        if (position)
+            return position;
     }
-
-    session->changeflag = 1;
+    position = createposition(session, prev, move, state, hashvalue,
+                              endpoint, checkequiv);
+    if (position && session->memorylimit)
+        enforcememorylimit(session, position);
     return position;
 }
 
+/* Replace a position's hash value, moving it to its new place in the
+ * hash table.
+ */
+void redo_setpositionhash(redo_session *session, redo_position *position,
+                          unsigned int hashvalue)
+{
+    removehashentry(session, position);
+    position->hashvalue = hashvalue;
+    sethashentry(session, position);
+}
+
 /* Delete a leaf node position from the session. The return value is
  * the position's parent node, or the original position if it cannot
  * be deleted.
@@ -726,7 +2788,6 @@ redo_position *redo_dropposition(redo_session *session,
                                  redo_position *position)
 {
     redo_position *prev;
-    redo_position *better, *pos;
 
     if (!position->prev || position->next)
         return position;
@@ -734,15 +2795,9 @@ redo_position *redo_dropposition(redo_session *session,
     if (!dropmoveto(session, prev, position))
         return position;
 
-    better = position->better;
-    for (pos = session->parray ; pos ; pos = pos->prev)
-        for ( ; pos->inarray ; pos = incpos(session, pos))
-            if (pos->inuse && pos->better == position)
-                pos->better = better;
-
+    forgetposition(session, position);
     droppositionstruct(session, position);
     recalcsolutionsize(prev);
-    recalchashtable(session);
     session->changeflag = 1;
     return prev;
 }
@@ -755,18 +2810,18 @@ redo_position *redo_dropposition(redo_session *session,
 int redo_suppresscycle(redo_session *session, redo_position **pposition,
                        void const *state, int prunelimit)
 {
-    redo_position *p;
-    int n;
+    return findcycle(session, pposition, state,
+                     hashstatedata(session, state), prunelimit);
+}
 
-    for (p = *pposition, n = 0 ; p ; p = p->prev, ++n) {
-        if (comparestatedata(session, p, state)) {
-            if (n < prunelimit)
-                prunebranch(session, *pposition, p);
-            *pposition = p;
-            return 1;
-        }
-    }
-    return 0;
+/* Check for a cycle in the same way as redo_suppresscycle(), but
+ * using the caller's hash value.
+ */
+int redo_suppresscyclehashed(redo_session *session, redo_position **pposition,
+                             void const *state, unsigned int hashvalue,
+                             int prunelimit)
+{
+    return findcycle(session, pposition, state, hashvalue, prunelimit);
 }
 
 /* Find the path of the best solution emanating from src and make a
@@ -780,6 +2835,8 @@ int redo_duplicatepath(redo_session *session,
 
     if (!src->solutionend)
         return 0;
+    if (!isexactmatch(session, src, holdstatedata(session, dest)))
+        return 0;
 
     while (src && src->solutionend) {
         for (branch = src->next ; branch ; branch = branch->cdr)
@@ -788,13 +2845,14 @@ int redo_duplicatepath(redo_session *session,
                 break;
         if (!branch)
             break;
-        next = redo_addposition(session, dest, branch->move,
-                                getstatedata(branch->p),
-                                branch->p->endpoint, 0);
+        next = redo_addpositionhashed(session, dest, branch->move,
+                                      holdstatedata(session, branch->p),
+                                      branch->p->hashvalue,
+                                      branch->p->endpoint, 0);
         if (!next)
             return 0;
         if (!dest->better && dest->movecount >= src->movecount)
-            dest->better = src->better ? src->better : (redo_position*)src;
+            dest->better = getrepresentative((redo_position*)src);
         src = branch->p;
         dest = next;
     }
@@ -802,20 +2860,36 @@ int redo_duplicatepath(redo_session *session,
 }
 
 /* Find all positions with setbetter flagged and initialize their
- * better field.
+ * better field. When the hash table is present, each set of positions
+ * with identical states is resolved all at once, instead of
+ * searching the session separately for every flagged position.
  */
-int redo_setbetterfields(redo_session const *session)
+int redo_setbetterfields(redo_session *session)
 {
     redo_position *position, *other;
+    void const *state;
+    unsigned int i;
     int count;
 
     count = 0;
+    if (session->hashtable) {
+        for (i = 0 ; i < session->hashtablesize ; ++i) {
+            position = getindexedposition(session, session->hashtable[i]);
+            for ( ; position ; position = gethashnext(session, position))
+                if (position->setbetter)
+                    count += resolveequivclass(session, position);
+        }
+        return count;
+    }
+
     for (position = session->parray ; position ; position = position->prev) {
-        for ( ; position->inarray ; position = incpos(session, position)) {
+        for ( ; position->stored != endofchunk ;
+                position = incpos(session, position)) {
             if (!position->inuse)
                 continue;
             if (position->setbetter) {
-                other = checkforequiv(session, getstatedata(position));
+                state = holdstatedata(session, position);
+                other = checkforequiv(session, state, position->hashvalue);
                 position->better = other;
                 if (other)
                     ++count;
@@ -833,6 +2907,28 @@ int redo_setbetterfields(redo_session const *session)
     return count;
 }
 
+/* Compute a state's hash value using the library's hash function.
+ */
+unsigned int redo_hashstate(void const *state, int size)
+{
+    return gethashvalue(state, size);
+}
+
+/* Return the tally of hash value collisions.
+ */
+unsigned long redo_getcollisioncount(redo_session const *session)
+{
+    return session->collisions;
+}
+
+/* Fill in a description of the session's memory.
+ */
+void redo_getmemorystats(redo_session const *session,
+                         redo_memorystats *stats)
+{
+    describememory(session, stats);
+}
+
 /* Return the change flag's current value.
  */
 int redo_hassessionchanged(redo_session const *session)
@@ -849,24 +2945,161 @@ int redo_clearsessionchanged(redo_session *session)
     return flag;
 }
 
+/* Return the new location of a position that has been copied by
+ * redo_compactsession(). The old position's prev field is used to
+ * hold the forwarding address.
+ */
+static redo_position *relocated(redo_position *position)
+{
+    return position ? position->prev : NULL;
+}
+
+/* Copy every position into a single new chunk, in the order that
+ * they appear in the old chunks. The new chunk has exactly one unused
+ * element left over, and the positions are renumbered from zero in a
+ * new table of pages. All
+ * references are redirected while the old chunks are still present
+ * to supply the forwarding addresses, after which the old chunks are
+ * freed.
+ */
+int redo_compactsession(redo_session *session,
+                        redo_position **positions, int count)
+{
+    redo_position *oldparray, *oldpfree, *pos, *dest, *p;
+    redo_position **oldpages;
+    redo_branch *branch, *b, **link;
+    unsigned int oldpagecount, oldpagealloc, pchunksize, pchunkcount;
+    unsigned long pslotcount;
+    unsigned int index, i;
+    size_t offset;
+    void *block;
+
+    if (count < 0 || (count > 0 && !positions))
+        return 0;
+    offset = getelementoffset(session->indexthreshold);
+    oldparray = session->parray;
+    oldpfree = session->pfree;
+    oldpages = session->pages;
+    oldpagecount = session->pagecount;
+    oldpagealloc = session->pagealloc;
+    pchunksize = session->pchunksize;
+    pchunkcount = session->pchunkcount;
+    pslotcount = session->pslotcount;
+    session->parray = NULL;
+    session->pages = NULL;
+    session->pagecount = 0;
+    session->pagealloc = 0;
+    session->pchunkcount = 0;
+    session->pslotcount = 0;
+    session->pchunksize = session->positioncount + 2;
+    if (!newposarray(session)) {
+        freeposarray(session, session->parray);
+        deallocate(session, session->pages);
+        session->pages = oldpages;
+        session->pagecount = oldpagecount;
+        session->pagealloc = oldpagealloc;
+        session->parray = oldparray;
+        session->pfree = oldpfree;
+        session->pchunksize = pchunksize;
+        session->pchunkcount = pchunkcount;
+        session->pslotcount = pslotcount;
+        return 0;
+    }
+    session->pchunksize = pchunksize;
+    session->clockhand = NULL;
+    session->stalledkeep = NULL;
+
+    dest = session->parray;
+    index = 0;
+    for (pos = oldparray ; pos ; pos = pos->prev) {
+        for ( ; pos->stored != endofchunk ; pos = incpos(session, pos)) {
+            if (pos->inuse) {
+                if (pos->stored == heldseparate) {
+                    block = getstateblock(dest);
+                    memcpy((char*)dest - offset, (char*)pos - offset,
+                           session->elementsize);
+                    setstateblock(dest, block);
+                    memcpy(block, getstateblock(pos), session->statesize);
+                } else {
+                    memcpy((char*)dest - offset, (char*)pos - offset,
+                           session->elementsize);
+                }
+                dest->hashnext = index++;
+                pos->prev = dest;
+                dest = incpos(session, dest);
+            }
+        }
+    }
+    session->pfree = dest;
+
+    if (session->hashtable) {
+        for (i = 0 ; i < session->hashtablesize ; ++i) {
+            p = NULL;
+            for (index = session->hashtable[i] ; index != noindex ;
+                                                 index = pos->hashnext) {
+                pos = getpageelement(session, oldpages, index);
+                if (p)
+                    p->hashnext = pos->prev->hashnext;
+                else
+                    session->hashtable[i] = pos->prev->hashnext;
+                p = pos->prev;
+            }
+            if (p)
+                p->hashnext = noindex;
+        }
+    }
+
+    for (pos = session->parray ; pos != session->pfree ;
+                                 pos = incpos(session, pos)) {
+        pos->prev = relocated(pos->prev);
+        pos->better = relocated(pos->better);
+        link = &pos->next;
+        for (branch = pos->next ; branch ; branch = branch->cdr) {
+            p = relocated(branch->p);
+            b = getincomingbranch(p);
+            b->move = branch->move;
+            b->p = p;
+            *link = b;
+            link = &b->cdr;
+        }
+        *link = NULL;
+        if (pos->indexed)
+            fillbranchindex(*getindexfield(pos), pos);
+    }
+    session->root = relocated(session->root);
+    for (i = 0 ; i < (unsigned int)count ; ++i)
+        positions[i] = relocated(positions[i]);
+
+    deallocate(session, oldpages);
+    for (pos = oldparray ; pos ; pos = p) {
+        for (p = pos ; p->stored != endofchunk ; p = incpos(session, p)) ;
+        p = p->prev;
+        freeposarray(session, pos);
+    }
+    return 1;
+}
+
 /* Free all memory associated with the session.
  */
 void redo_endsession(redo_session *session)
 {
     redo_position *position, *p;
-    redo_branch *branch, *b;
 
     if (!session)
         return;
     for (position = session->parray ; position ; position = p) {
-        for (p = position ; p->inarray ; p = incpos(session, p)) ;
+        for (p = position ; p->stored != endofchunk ; p = incpos(session, p)) {
+            if (p->inuse) {
+                freestatedata(session, p);
+                dropbranchindex(session, p);
+            }
+        }
         p = p->prev;
-        free(position);
-    }
-    for (branch = session->barray ; branch ; branch = b) {
-        b = branch->cdr;
-        free(branch);
+        freeposarray(session, position);
     }
-    free(session->hashtable);
-    free(session);
+    deallocate(session, session->pages);
+    deallocate(session, session->hashtable);
+    deallocate(session, session->canonbuf);
+    deallocate(session, session->statebuf);
+    deallocate(session, session);
 }
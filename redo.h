@@ -10,13 +10,15 @@
 #ifndef _libredo_redo_h_
 #define _libredo_redo_h_
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/* The library version: 0.9
+/* The library version: 0.10
  */
-#define REDO_LIBRARY_VERSION 0x0009
+#define REDO_LIBRARY_VERSION 0x000A
 
 /*
  * Types.
@@ -29,23 +31,74 @@ typedef struct redo_session redo_session;
 typedef struct redo_position redo_position;
 typedef struct redo_branch redo_branch;
 
+/* The type of the position fields that count moves and branches. By
+ * default these are 16-bit, which limits a line of play to 65535
+ * moves, and a position to 65535 branches. Defining REDO_WIDE_COUNTS
+ * makes them 32-bit, at the cost of a larger position struct. The
+ * setting must be the same when compiling the library and the
+ * programs that use it.
+ */
+#ifdef REDO_WIDE_COUNTS
+typedef unsigned int redo_count;
+#else
+typedef unsigned short redo_count;
+#endif
+
 /* The information associated with a visited state.
  */
 struct redo_position {
     redo_position *prev;        /* position that points to this position */
     redo_branch *next;          /* linked list of moves from this position */
     redo_position *better;      /* position equal to this one in fewer moves */
-    unsigned short movecount;   /* number of moves to reach this position */
-    unsigned short solutionsize; /* size of best solution from this position */
-    unsigned short nextcount;   /* number of moves in next list */
+    unsigned int hashvalue;     /* internal: the state hash value */
+    redo_count movecount;       /* number of moves to reach this position */
+    redo_count solutionsize;    /* size of best solution from this position */
+    redo_count nextcount;       /* number of moves in next list */
     signed char endpoint;       /* non-zero if this position is an endpoint */
     signed char solutionend;    /* endpoint for best solution from here */
-    unsigned int hashvalue:16;  /* internal: the state hash value */
+    unsigned int hashnext:25;   /* internal: next position in hash bucket */
     unsigned int setbetter:1;   /* internal: set by redo_checkequivlater */
+    unsigned int touched:1;     /* internal: set when visited by the caller */
     unsigned int inuse:1;       /* internal: false if not in the tree */
-    unsigned int inarray:1;     /* internal: false at the end of the array */
+    unsigned int indexed:1;     /* internal: true if next list is indexed */
+    unsigned int stored:3;      /* internal: how the state data is stored */
 };
 
+/* The types of the caller-supplied functions for hashing and
+ * comparing state data. Both are given the number of comparing bytes
+ * in the state data, and the data pointer that was provided along
+ * with the functions. The hash function returns the hash value for a
+ * state. The comparison function returns zero if two states are
+ * identical, and non-zero otherwise.
+ */
+typedef unsigned int (*redo_hashcallback)(void const *state, int size,
+                                          void *data);
+typedef int (*redo_cmpcallback)(void const *state1, void const *state2,
+                                int size, void *data);
+
+/* The type of the caller-supplied function for canonicalizing state
+ * data. It is given the comparing bytes of a state, and must store
+ * the canonical form of that state in the size bytes at canon.
+ */
+typedef void (*redo_canoncallback)(void *canon, void const *state, int size,
+                                   void *data);
+
+/* The type of the caller-supplied function for applying moves. It is
+ * given the state of a position, and must change the state's
+ * comparing bytes to those of the position reached by making the
+ * given move.
+ */
+typedef void (*redo_movecallback)(void *state, int size, int move,
+                                  void *data);
+
+/* The types of the caller-supplied functions for allocating and
+ * freeing memory. Both are given the context pointer that was
+ * provided along with the functions. The allocation function returns
+ * NULL if the memory is unavailable.
+ */
+typedef void *(*redo_alloccallback)(size_t size, void *context);
+typedef void (*redo_freecallback)(void *ptr, void *context);
+
 /* A labeled branch in the tree of visited states.
  */
 struct redo_branch {
@@ -61,8 +114,10 @@ struct redo_branch {
 /* Create and return a new redo session. initialstate points to a
  * buffer that contains the representation of the state of the
  * starting position, from which all other positions will descend.
- * size is the size of the state representation in bytes. It cannot be
- * larger than ~63k (and ideally should be as small as possible).
+ * size is the size of the state representation in bytes. There is no
+ * fixed upper limit, but it should ideally be as small as possible;
+ * for states of many kilobytes, consider one of the storage modes
+ * that avoid storing a complete copy of every state.
  * cmpsize is number of bytes in the state representation to actually
  * compare, or zero to use the entire state representation. NULL is
  * returned if the arguments are invalid, or if memory for the session
@@ -71,6 +126,20 @@ struct redo_branch {
 extern redo_session *redo_beginsession(void const *initialstate,
                                        int size, int cmpsize);
 
+/* Create and return a new redo session, as with redo_beginsession(),
+ * that obtains all of its memory from the caller's allocation
+ * functions. allocfunc and freefunc are used for the session itself
+ * and for everything that the session allocates afterwards, until the
+ * session is freed by redo_endsession(). context is passed to both
+ * functions unchanged. If either function is NULL, the standard
+ * malloc() and free() are used instead.
+ */
+extern redo_session *redo_beginsessionalloc(void const *initialstate,
+                                            int size, int cmpsize,
+                                            redo_alloccallback allocfunc,
+                                            redo_freecallback freefunc,
+                                            void *context);
+
 /* Possible values for the grafting argument to redo_setgraftbehavior().
  */
 enum { redo_nograft = 0, redo_graft, redo_copypath, redo_graftandcopy };
@@ -90,6 +159,123 @@ enum { redo_nograft = 0, redo_graft, redo_copypath, redo_graftandcopy };
  */
 extern int redo_setgraftbehavior(redo_session *session, int grafting);
 
+/* Change the load target of the session's hash table, which is used
+ * to find positions with identical states. load is the average number
+ * of positions per hash table bucket, expressed as a percentage. The
+ * table is enlarged whenever the session grows past this target.
+ * Lower values use more memory in exchange for faster lookups. The
+ * default value is 100. Values outside of the range 1 to 65535 leave
+ * the option unchanged. The return value is the option's previous
+ * value.
+ */
+extern int redo_sethashload(redo_session *session, int load);
+
+/* Replace the functions used to hash and compare state data. By
+ * default, the comparing bytes of the state data are hashed with a
+ * general-purpose hash function, and compared with memcmp(). hashfunc
+ * and cmpfunc replace these, and data is passed to each of them
+ * whenever they are called. Either function pointer can be NULL to
+ * select the default. The two functions must agree with each other:
+ * states that cmpfunc considers identical must be given identical
+ * hash values by hashfunc. Every position in the session is rehashed
+ * when the hash function is changed, so ideally this function should
+ * be called immediately after redo_beginsession(). (Note that this
+ * will overwrite any hash values supplied by the caller via
+ * redo_addpositionhashed(), and that existing better fields are not
+ * re-examined.)
+ */
+extern void redo_setstatecallbacks(redo_session *session,
+                                   redo_hashcallback hashfunc,
+                                   redo_cmpcallback cmpfunc, void *data);
+
+/* Possible values for the mode argument to redo_setstoragemode().
+ */
+enum {
+    redo_storefull = 0, redo_storedeltas, redo_storekeyframes,
+    redo_storeinterned, redo_storeseparate
+};
+
+/* Change how the session stores the state data of its positions.
+ * redo_storefull, the default, stores a complete copy of the state
+ * with every position. redo_storedeltas stores, for most positions,
+ * only the comparing bytes that differ from the previous position's
+ * state. In this mode, every so often a complete copy of the
+ * comparing bytes is stored instead; interval sets the largest number
+ * of positions in a row that can be stored as differences (zero
+ * selects the default of 32). redo_storekeyframes stores no comparing
+ * bytes at all for most positions, and recreates their states by
+ * applying moves to the previous position's state (see
+ * redo_setmovecallback()). A complete copy is stored at positions
+ * that have more than one following move, and wherever there would
+ * otherwise be more than interval positions in a row without one.
+ * redo_storeinterned stores the comparing bytes separately from the
+ * positions, and stores only one copy of them for all positions that
+ * have identical comparing bytes (interval is ignored). In all of
+ * these modes, the extra bytes are stored with every position. States
+ * are reconstructed as needed, and redo_getsavedstate() returns a
+ * pointer to a buffer that is only valid until the next call to a
+ * libredo function. redo_storeseparate stores complete states, but in
+ * an area apart from the positions themselves, so that operations
+ * which only examine the positions do not need to load the state data
+ * into the cache (interval is ignored). The mode can only be changed
+ * while the session contains nothing but the initial position. The
+ * return value is false if the mode could not be changed.
+ */
+extern int redo_setstoragemode(redo_session *session, int mode, int interval);
+
+/* Install a function that applies a move to a state, which is needed
+ * for the redo_storekeyframes storage mode. data is passed to movefunc
+ * whenever it is called. The function must not call any libredo
+ * functions, and the comparing bytes that it produces must depend
+ * only on the move and the comparing bytes of the state it is given.
+ * The return value is false if movefunc is NULL and the session is
+ * using the redo_storekeyframes mode.
+ */
+extern int redo_setmovecallback(redo_session *session,
+                                redo_movecallback movefunc, void *data);
+
+/* Change the number of elements in the next chunk of memory allocated
+ * for positions. Positions (together with the branches that lead to
+ * them) are allocated in chunks, starting with small chunks and doubling
+ * the size of each successive chunk, until they reach several
+ * megabytes. A program that expects its session to grow large can
+ * use this function to skip ahead, and growth continues from the
+ * given size. Values outside of the range 2 to 16777216 leave the
+ * option unchanged. The return value is the option's previous value.
+ */
+extern int redo_setchunksize(redo_session *session, int size);
+
+/* Index the branches of positions that have many of them. Once a
+ * position acquires threshold branches, its moves are entered into a
+ * hash table, so that redo_getnextposition() and redo_addposition()
+ * can find a move without walking the next list. Enabling indexes
+ * adds a pointer to the memory used by every position. A threshold of
+ * zero, the default, disables them. The setting can only be changed
+ * while the session contains only its initial position. The return
+ * value is false if the session has other positions or threshold is
+ * not between 0 and 65535.
+ */
+extern int redo_setbranchindex(redo_session *session, int threshold);
+
+/* Install a function that reduces states to a canonical form before
+ * they are hashed and compared, so that states that are equivalent
+ * (e.g. under some symmetry of the game) are treated as identical.
+ * data is passed to canonfunc whenever it is called, and canonfunc
+ * can be NULL to remove a previously installed function. The
+ * canonical form is only used for finding identical states; the
+ * state data stored in each position is left unchanged. Any hash
+ * functions and hash values supplied by the caller apply to the
+ * canonical form. As with redo_setstatecallbacks(), every position in
+ * the session is rehashed, and so this function should ideally be
+ * called immediately after redo_beginsession(). Positions whose states
+ * are equivalent but not identical share better fields, but subtrees
+ * are never grafted or copied between them, and redo_suppresscycle()
+ * does not treat them as a cycle. The return value is false if memory
+ * could not be allocated for the canonical states.
+ */
+extern int redo_setcanonicalizer(redo_session *session,
+                                 redo_canoncallback canonfunc, void *data);
+
 /* Return the position for the initial state.
  */
 extern redo_position *redo_getfirstposition(redo_session const *session);
@@ -99,7 +285,8 @@ extern redo_position *redo_getfirstposition(redo_session const *session);
 extern int redo_getsessionsize(redo_session const *session);
 
 /* Return a read-only pointer to the copied state associated with a
- * position.
+ * position. (If the session's storage mode reconstructs states, the
+ * pointer is only valid until the next call to a libredo function.)
  */
 extern void const *redo_getsavedstate(redo_position const *position);
 
@@ -129,13 +316,40 @@ enum { redo_nocheck = 0, redo_check, redo_checklater };
  * redo_checklater will delay this check until the next call to
  * redo_setbetterfields(). Finally, a value of redo_nocheck will
  * bypass this check entirely. NULL is returned if a new position
- * cannot be allocated.
+ * cannot be allocated, or if prev has already reached the largest
+ * move count or branch count that a position can hold.
  */
 extern redo_position *redo_addposition(redo_session *session,
                                        redo_position *prev, int move,
                                        void const *state, int endpoint,
                                        int checkequiv);
 
+/* Identical to redo_addposition(), except that the caller provides
+ * the hash value for the state, instead of having the library compute
+ * it from the state data. This allows a caller that already tracks a
+ * hash of its state (e.g. incrementally) to avoid the cost of having
+ * the state data hashed. The hash value must be computed from the
+ * comparing bytes of the state only, so that identical states always
+ * have identical hash values. A session should use one method of
+ * hashing consistently: the library's hash values and the caller's
+ * hash values cannot be compared with each other. (Use
+ * redo_setpositionhash() to replace the hash value of the initial
+ * position, which is created by redo_beginsession().)
+ */
+extern redo_position *redo_addpositionhashed(redo_session *session,
+                                             redo_position *prev, int move,
+                                             void const *state,
+                                             unsigned int hashvalue,
+                                             int endpoint, int checkequiv);
+
+/* Replace the hash value that is stored for a position. The caller is
+ * responsible for ensuring that the session's hash values remain
+ * consistent, as per redo_addpositionhashed().
+ */
+extern void redo_setpositionhash(redo_session *session,
+                                 redo_position *position,
+                                 unsigned int hashvalue);
+
 /* Delete a position from the session. In order to be deleted, the
  * position must be a leaf node, i.e. it must not have any branches
  * emanating from it to other positions. Any better fields in the
@@ -161,11 +375,31 @@ extern redo_position *redo_dropposition(redo_session *session,
 extern int redo_suppresscycle(redo_session *session, redo_position **pposition,
                               void const *state, int prunelimit);
 
+/* Limit how far redo_suppresscycle() will search back along a path
+ * for a matching state. If limit is positive, only that many
+ * positions (starting with the one passed to redo_suppresscycle()) are
+ * examined. A limit of zero, the default, means that the entire path
+ * back to the initial position can be examined. Negative values leave
+ * the option unchanged. The return value is the option's previous
+ * value.
+ */
+extern int redo_setcyclesearchlimit(redo_session *session, int limit);
+
+/* Identical to redo_suppresscycle(), except that the caller provides
+ * the hash value for the state, as per redo_addpositionhashed().
+ */
+extern int redo_suppresscyclehashed(redo_session *session,
+                                    redo_position **pposition,
+                                    void const *state, unsigned int hashvalue,
+                                    int prunelimit);
+
 /* Copy the entire sequence of moves leading to the shortest solution
  * from src to the dest position. Nothing is done if no solution path
  * currently exists starting from src. The session's state is
  * undefined if src and dest do not represent identical states. false
- * is returned if sufficient memory was unavailable.
+ * is returned if sufficient memory was unavailable, or if a
+ * canonicalizing function is in use and the states of src and dest
+ * are only equivalent.
  */
 extern int redo_duplicatepath(redo_session *session,
                               redo_position *dest, redo_position const *src);
@@ -186,7 +420,64 @@ extern void redo_updatesavedstate(redo_session const *session,
  * then recreate the values on deserialization.) The return value is
  * the number of better pointers that were set.
  */
-extern int redo_setbetterfields(redo_session const *session);
+extern int redo_setbetterfields(redo_session *session);
+
+/* Return the hash value that the library computes by default for a
+ * state of the given size. (If the session has a cmpsize, that is the
+ * size that should be given here.) This can be used to supply hash
+ * values for redo_addpositionhashed() that are compatible with those
+ * the library computes itself.
+ */
+extern unsigned int redo_hashstate(void const *state, int size);
+
+/* Return the number of times that the state data of a position was
+ * compared against another state that had the same hash value but
+ * was not identical. A low number indicates that the session's hash
+ * table is filtering out nearly all unnecessary comparisons.
+ */
+extern unsigned long redo_getcollisioncount(redo_session const *session);
+
+/* A description of the memory held by a session, as filled in by
+ * redo_getmemorystats().
+ */
+typedef struct redo_memorystats redo_memorystats;
+struct redo_memorystats {
+    size_t totalbytes;          /* all memory held by the session */
+    size_t positionbytes;       /* memory in the position chunks */
+    size_t positionusedbytes;   /* the part of it in use by the tree */
+    size_t statebytes;          /* state data stored apart from the chunks */
+    size_t hashtablebytes;      /* memory used by the hash table */
+    size_t otherbytes;          /* the session itself and its buffers */
+    unsigned long positionchunks; /* the number of position chunks */
+    unsigned long positionslots; /* how many positions the chunks can hold */
+    unsigned long freepositions; /* how many of those slots are unused */
+    int positionsize;           /* bytes used by each position slot */
+    int positionfragmentation;  /* percentage of position slots unused */
+};
+
+/* Fill in stats with a description of the memory that the session
+ * currently holds. The unused slots are memory that would be returned
+ * by a call to redo_compactsession().
+ */
+extern void redo_getmemorystats(redo_session const *session,
+                                redo_memorystats *stats);
+
+/* Set a limit on the memory that the session uses, in bytes, as
+ * reported by redo_getmemorystats() but not counting unused slots.
+ * When redo_addposition() or redo_addpositionhashed() creates a
+ * position that takes the session over the limit, the least recently
+ * visited positions are deleted until it is back under. Only leaf
+ * positions that are not part of a solution are deleted (but their
+ * parents can become such leaves in turn), and never the position
+ * being returned. Positions are visited by being created or returned
+ * by redo_addposition() or redo_getnextposition(); following a prev
+ * field or calling redo_getfirstposition() does not count. Any other
+ * pointers to positions that the caller holds can therefore become
+ * invalid. If nothing can be deleted, the session is left over its
+ * limit. A limit of zero, the default, disables the limit. The return
+ * value is the previous limit.
+ */
+extern size_t redo_setmemorylimit(redo_session *session, size_t limit);
 
 /* Return true if positions have been added to or removed from the
  * session since it was initialized, or since the last call to
@@ -198,6 +489,21 @@ extern int redo_hassessionchanged(redo_session const *session);
  */
 extern int redo_clearsessionchanged(redo_session *session);
 
+/* Move all of the positions in the session into newly
+ * allocated memory, packed together, and free the memory that was
+ * previously used. This returns the memory left over from deleted
+ * positions, and makes operations that examine every position
+ * faster. Every position has a new address upon return, so any
+ * pointers to positions that the caller holds become invalid. The
+ * caller can supply an array of count such pointers in positions,
+ * which will be updated to point to the moved positions. The return
+ * value is false if count is negative, or positive with positions
+ * NULL, or if the memory could not be allocated. In each case the
+ * session is unchanged.
+ */
+extern int redo_compactsession(redo_session *session,
+                               redo_position **positions, int count);
+
 /* Delete the sesssion and free all associated memory.
  */
 extern void redo_endsession(redo_session *session);